@@ -0,0 +1,287 @@
+// Microbenchmarks of the wfs operations, called directly on a scratch disk rather than
+// through a FUSE mount, so kernel round trips do not add noise to the numbers
+#define WFS_NO_MAIN
+#include "mount.wfs.c"
+#include <sys/stat.h>
+
+#define BENCH_FILES 128         // files per directory, as many as fit the disk with room to spare
+#define BENCH_DEPTH 16          // directories in the deep path
+#define BENCH_LOOKUPS 10000     // operations of the scenarios that do not append to the log
+#define BENCH_SEQ_WRITE 256     // bytes per sequential write
+#define BENCH_SEQ_WRITES 64
+#define BENCH_RAND_FILE 8192    // size of the file written at random
+#define BENCH_RAND_WRITE 256
+#define BENCH_RAND_WRITES 80
+#define BENCH_READ_FILE (64 * 1024)
+#define BENCH_READ 4096
+
+static char paths[BENCH_FILES][MAX_PATH_LEN];   // paths the steps of a scenario work on
+static char deep_path[MAX_PATH_LEN];
+static ulong order[BENCH_LOOKUPS];              // random indexes into paths, or offsets
+static char data[BENCH_READ_FILE];
+
+/**
+ * Formats the scratch disk like mkfs.wfs, and forgets everything known of the last one.
+*/
+static void bench_format() {
+    for (ulong inode_number = 0; inode_number < imap_len; inode_number++)
+        free(imap[inode_number].wbuf);
+    free(imap);
+    imap = NULL;
+    imap_len = 0;
+    imap_max_inumber = 0;
+    imap_head = sizeof(struct wfs_sb);
+    live_bytes = dead_bytes = live_inodes = 0;
+    counted_head = sizeof(struct wfs_sb);
+    log_pending = 0;
+    dcache_drop(0);
+
+    memset(mapped_disk, 0, DISK_SIZE);
+    struct wfs_sb *superblock = (struct wfs_sb *)mapped_disk;
+    superblock->magic = WFS_MAGIC;
+    superblock->head = sizeof(struct wfs_sb) + sizeof(struct wfs_inode);
+    struct wfs_inode *root = (struct wfs_inode *)(mapped_disk + sizeof(struct wfs_sb));
+    root->mode = S_IFDIR;
+    root->uid = getuid();
+    root->gid = getgid();
+    root->atime = root->mtime = root->ctime = time(NULL);
+    root->links = 1;
+    struct wfs_ckpt *checkpoint = (struct wfs_ckpt *)(mapped_disk + WFS_CKPT_OFFSET);
+    *checkpoint = (struct wfs_ckpt){ WFS_CKPT_MAGIC, superblock->head, sizeof(struct wfs_inode), 0, 1 };
+    load_checkpoint();
+}
+
+/**
+ * Fails the benchmark on an operation that should not fail.
+*/
+static void bench_check(int ret, const char *what) {
+    if (ret >= 0) return;
+    fprintf(stderr, "%s: %s\n", what, strerror(-ret));
+    exit(EXIT_FAILURE);
+}
+
+static void shuffle(ulong *values, size_t n) {
+    for (size_t i = n - 1; i > 0; i--) {
+        size_t j = lrand48() % (i + 1);
+        ulong value = values[i];
+        values[i] = values[j];
+        values[j] = value;
+    }
+}
+
+/**
+ * Names the files of a directory in paths, and puts their indexes in order, shuffled.
+*/
+static void name_files(const char *dir) {
+    for (int i = 0; i < BENCH_FILES; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "%s/f%d", dir, i);
+        order[i] = i;
+    }
+    shuffle(order, BENCH_FILES);
+}
+
+static void make_files(const char *dir) {
+    name_files(dir);
+    for (int i = 0; i < BENCH_FILES; i++)
+        bench_check(wfs_ops.mknod(paths[i], S_IFREG | 0644, 0), "mknod");
+}
+
+static void setup_create() {
+    name_files("");
+}
+
+static int step_create(int i) {
+    return wfs_ops.mknod(paths[i], S_IFREG | 0644, 0);
+}
+
+static int step_mkdir(int i) {
+    return wfs_ops.mkdir(paths[i], 0755);
+}
+
+static void setup_deep_stat() {
+    deep_path[0] = '\0';
+    for (int depth = 0; depth < BENCH_DEPTH; depth++) {
+        strcat(deep_path, "/d");
+        bench_check(wfs_ops.mkdir(deep_path, 0755), "mkdir");
+    }
+}
+
+static int step_deep_stat(int i) {
+    struct stat st;
+    return wfs_ops.getattr(deep_path, &st);
+}
+
+static void setup_seq_write() {
+    bench_check(wfs_ops.mknod("/seq", S_IFREG | 0644, 0), "mknod");
+}
+
+static int step_seq_write(int i) {
+    return wfs_ops.write("/seq", data, BENCH_SEQ_WRITE, (off_t)i * BENCH_SEQ_WRITE, NULL);
+}
+
+static void setup_rand_write() {
+    bench_check(wfs_ops.mknod("/rand", S_IFREG | 0644, 0), "mknod");
+    bench_check(wfs_ops.write("/rand", data, BENCH_RAND_FILE, 0, NULL), "write");
+    for (int i = 0; i < BENCH_RAND_WRITES; i++)
+        order[i] = lrand48() % (BENCH_RAND_FILE - BENCH_RAND_WRITE + 1);
+}
+
+static int step_rand_write(int i) {
+    return wfs_ops.write("/rand", data, BENCH_RAND_WRITE, order[i], NULL);
+}
+
+static void setup_read() {
+    bench_check(wfs_ops.mknod("/read", S_IFREG | 0644, 0), "mknod");
+    bench_check(wfs_ops.write("/read", data, BENCH_READ_FILE, 0, NULL), "write");
+    for (int i = 0; i < BENCH_LOOKUPS; i++)
+        order[i] = lrand48() % (BENCH_READ_FILE / BENCH_READ) * BENCH_READ;
+}
+
+static int step_read(int i) {
+    static char buf[BENCH_READ];
+    return wfs_ops.read("/read", buf, BENCH_READ, order[i], NULL);
+}
+
+static void setup_dir_lookup() {
+    bench_check(wfs_ops.mkdir("/big", 0755), "mkdir");
+    make_files("/big");
+    for (int i = 0; i < BENCH_LOOKUPS; i++)
+        order[i] = lrand48() % BENCH_FILES;
+}
+
+static int step_dir_lookup(int i) {
+    struct stat st;
+    return wfs_ops.getattr(paths[order[i]], &st);
+}
+
+static int readdir_fill(void *buf, const char *name, const struct stat *st, off_t off) {
+    return 0;
+}
+
+static int step_readdir(int i) {
+    return wfs_ops.readdir("/big", NULL, readdir_fill, 0, NULL);
+}
+
+static void setup_delete_storm() {
+    make_files("");
+}
+
+static int step_delete_storm(int i) {
+    return wfs_ops.unlink(paths[order[i]]);
+}
+
+static const struct {
+    const char *name;
+    const char *op;             // operation timed by the steps
+    void (*setup)();            // prepares a freshly formatted disk for the steps, not timed
+    int (*step)(int i);         // runs step i, returning what the operation returned
+    int steps;
+} scenarios[] = {
+    { "create",       "mknod",   setup_create,       step_create,       BENCH_FILES },
+    { "mkdir",        "mkdir",   setup_create,       step_mkdir,        BENCH_FILES },
+    { "deep_stat",    "getattr", setup_deep_stat,    step_deep_stat,    BENCH_LOOKUPS },
+    { "seq_write",    "write",   setup_seq_write,    step_seq_write,    BENCH_SEQ_WRITES },
+    { "rand_write",   "write",   setup_rand_write,   step_rand_write,   BENCH_RAND_WRITES },
+    { "read",         "read",    setup_read,         step_read,         BENCH_LOOKUPS },
+    { "dir_lookup",   "getattr", setup_dir_lookup,   step_dir_lookup,   BENCH_LOOKUPS },
+    { "readdir",      "readdir", setup_dir_lookup,   step_readdir,      BENCH_LOOKUPS / 10 },
+    { "delete_storm", "unlink",  setup_delete_storm, step_delete_storm, BENCH_FILES },
+};
+#define SCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t value_a = *(const uint64_t *)a, value_b = *(const uint64_t *)b;
+    return (value_a > value_b) - (value_a < value_b);
+}
+
+/**
+ * Runs a scenario for a number of rounds, each on a freshly formatted disk, and prints its
+ * throughput and latency percentiles as a JSON object.
+*/
+static void run_scenario(size_t scenario, int rounds) {
+    int steps = scenarios[scenario].steps;
+    uint64_t *latencies = malloc((size_t)rounds * steps * sizeof(uint64_t));
+    if (latencies == NULL) {
+        perror("Error allocating latencies");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t total_ns = 0;
+    size_t n = 0;
+    for (int round = 0; round < rounds; round++) {
+        // The same sequence of operations in every run, for comparable numbers
+        srand48(round + 1);
+        bench_format();
+        scenarios[scenario].setup();
+        for (int i = 0; i < steps; i++) {
+            uint64_t start = now_ns();
+            int ret = scenarios[scenario].step(i);
+            latencies[n] = now_ns() - start;
+            total_ns += latencies[n++];
+            bench_check(ret, scenarios[scenario].name);
+        }
+    }
+
+    qsort(latencies, n, sizeof(uint64_t), compare_u64);
+    printf("\"%s\":{\"op\":\"%s\",\"ops\":%zu,\"ops_per_s\":%.1f,\"avg_ns\":%lu,\"p50_ns\":%lu,\"p90_ns\":%lu,"
+           "\"p99_ns\":%lu,\"max_ns\":%lu}", scenarios[scenario].name, scenarios[scenario].op, n,
+           total_ns ? n * 1e9 / total_ns : 0.0, (ulong)(total_ns / n), (ulong)latencies[n / 2],
+           (ulong)latencies[n * 9 / 10], (ulong)latencies[n * 99 / 100], (ulong)latencies[n - 1]);
+    free(latencies);
+}
+
+int main(int argc, char *argv[]) {
+    int rounds = 5;
+    int first = 1;
+    if (argc >= 3 && !strcmp(argv[1], "-r")) {
+        rounds = atoi(argv[2]);
+        first = 3;
+    }
+    if (rounds <= 0) {
+        fprintf(stderr, "Usage: %s [-r rounds] [scenario ...]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    for (int arg = first; arg < argc; arg++) {
+        size_t scenario;
+        for (scenario = 0; scenario < SCENARIOS && strcmp(argv[arg], scenarios[scenario].name); scenario++);
+        if (scenario == SCENARIOS) {
+            fprintf(stderr, "Unknown scenario %s\n", argv[arg]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // A scratch disk, gone once the benchmark exits
+    char scratch[] = "/tmp/bench.wfs.XXXXXX";
+    int fd = mkstemp(scratch);
+    if (fd == -1 || unlink(scratch) == -1 || ftruncate(fd, DISK_SIZE) == -1) {
+        perror("Error creating scratch disk");
+        exit(EXIT_FAILURE);
+    }
+    mapped_disk = mmap(NULL, DISK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapped_disk == MAP_FAILED) {
+        perror("Error mapping scratch disk into memory");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+    disk_path = scratch;
+    disk_fd = fd;
+    summary_ns = 0;
+    memset(data, 'x', sizeof(data));
+
+    printf("{\"rounds\":%d,\"disk_size\":%d,\"scenarios\":{", rounds, DISK_SIZE);
+    int printed = 0;
+    for (size_t scenario = 0; scenario < SCENARIOS; scenario++) {
+        int selected = (first == argc);
+        for (int arg = first; arg < argc; arg++)
+            selected |= !strcmp(argv[arg], scenarios[scenario].name);
+        if (!selected) continue;
+        if (printed++) printf(",");
+        run_scenario(scenario, rounds);
+        fflush(stdout);
+    }
+    printf("}}\n");
+
+    munmap(mapped_disk, DISK_SIZE);
+    close(fd);
+    return 0;
+}
@@ -17,31 +17,76 @@ static int fsck() {
         struct wfs_log_entry *current_entry = (struct wfs_log_entry *)current_position;
         if (current_entry->inode.inode_number > max_inode_number)
             max_inode_number = current_entry->inode.inode_number;
-        current_position += sizeof(struct wfs_inode) + current_entry->inode.size;
+        current_position += wfs_entry_len(current_entry);
     }
     new_mapped_disk = malloc(DISK_SIZE);
     struct wfs_sb *new_superblock = (struct wfs_sb *)new_mapped_disk;
     new_superblock->magic = WFS_MAGIC;
     new_superblock->head = sizeof(struct wfs_sb);
+    uint32_t inodes = 0;
 
     for (ulong inode_number = 0; inode_number <= max_inode_number; inode_number++) {
         struct wfs_inode *latest_matching_entry = NULL;
+        struct wfs_log_entry *latest_data_entry = NULL;
+        struct wfs_data_use use = {0}; // how much of the latest data is still in the file
         current_position = mapped_disk + sizeof(struct wfs_sb);
 
         while (current_position < mapped_disk + superblock->head) {
             struct wfs_log_entry *current_entry = (struct wfs_log_entry *)current_position;
-            if (current_entry->inode.inode_number == inode_number)
+            if (current_entry->inode.inode_number == inode_number) {
                 latest_matching_entry = &(current_entry->inode);
-            current_position += sizeof(struct wfs_inode) + current_entry->inode.size;
+                if (current_entry->inode.flags == WFS_ENTRY_INODE)
+                    latest_data_entry = current_entry;
+                else if (current_entry->inode.flags == WFS_ENTRY_TOMBSTONE)
+                    latest_data_entry = NULL;
+                wfs_data_use_apply(&use, current_entry);
+            }
+            current_position += wfs_entry_len(current_entry);
         }
 
-        if (latest_matching_entry != NULL) {
-            memcpy(new_mapped_disk + new_superblock->head, latest_matching_entry, sizeof(*latest_matching_entry) + latest_matching_entry->size);
-            new_superblock->head += sizeof(*latest_matching_entry) + latest_matching_entry->size;
+        // Deleted inodes are dropped along with all of their entries. Older disks mark them
+        // deleted in their latest entry rather than with a tombstone.
+        if (latest_matching_entry != NULL &&
+            (latest_matching_entry->flags == WFS_ENTRY_TOMBSTONE || latest_matching_entry->deleted)) {
+            WFS_PROBE1(fsck__drop, inode_number);
+            continue;
+        }
+
+        // Fold the latest attributes and the latest data into a single entry. A file with a
+        // hole at its end keeps it, with an attribute entry carrying the full size.
+        if (latest_matching_entry != NULL && latest_data_entry != NULL) {
+            struct wfs_log_entry *new_entry = (struct wfs_log_entry *)(new_mapped_disk + new_superblock->head);
+            new_entry->inode = *latest_matching_entry;
+            new_entry->inode.flags = WFS_ENTRY_INODE;
+            new_entry->inode.size = use.size;
+            memcpy(new_entry->data, latest_data_entry->data, use.size);
+            new_superblock->head += wfs_entry_len(new_entry);
+            inodes++;
+            WFS_PROBE3(fsck__keep, inode_number, (char *)new_entry - new_mapped_disk, use.size);
+
+            if (use.size != latest_matching_entry->size) {
+                struct wfs_log_entry *attr_entry = (struct wfs_log_entry *)(new_mapped_disk + new_superblock->head);
+                attr_entry->inode = *latest_matching_entry;
+                attr_entry->inode.flags = WFS_ENTRY_ATTR;
+                new_superblock->head += wfs_entry_len(attr_entry);
+            }
         }
     }
 
     memset(new_mapped_disk + new_superblock->head, 0, DISK_SIZE - new_superblock->head);
+
+    WFS_PROBE2(fsck__done, superblock->head, new_superblock->head);
+
+    // Every entry left is live. A log still reaching over the checkpoint, on an old disk
+    // full of live data, goes without one.
+    if (new_superblock->head <= WFS_CKPT_OFFSET) {
+        struct wfs_ckpt *checkpoint = (struct wfs_ckpt *)(new_mapped_disk + WFS_CKPT_OFFSET);
+        checkpoint->magic = WFS_CKPT_MAGIC;
+        checkpoint->head = new_superblock->head;
+        checkpoint->live_bytes = new_superblock->head - sizeof(struct wfs_sb);
+        checkpoint->dead_bytes = 0;
+        checkpoint->inodes = inodes;
+    }
     memcpy(mapped_disk, new_mapped_disk, DISK_SIZE);
     free(new_mapped_disk);
 
@@ -44,6 +44,20 @@ static int init_filesystem(const char *path) {
         return -1;
     }
 
+    // Write the checkpoint, accounting for the root inode, over any left by an older filesystem
+    struct wfs_ckpt checkpoint = {
+        .magic = WFS_CKPT_MAGIC,
+        .head = superblock.head,
+        .live_bytes = sizeof(struct wfs_inode),
+        .dead_bytes = 0,
+        .inodes = 1
+    };
+    if (pwrite(fd, &checkpoint, sizeof(struct wfs_ckpt), WFS_CKPT_OFFSET) == -1) {
+        perror("Error writing checkpoint");
+        close(fd);
+        return -1;
+    }
+
     // Close the file
     close(fd);
 
@@ -1,11 +1,699 @@
+#define _GNU_SOURCE
 #define FUSE_USE_VERSION 30
 #include "wfs.h"
 #include <fuse.h>
+#include <fuse_opt.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <syslog.h>
 #include <sys/mman.h>
+#include <sys/statvfs.h>
+#include <linux/falloc.h>
+#include <linux/perf_event.h>
 
 static const char *disk_path = NULL; // absolute path to disk
 static char *mapped_disk = NULL; // address of disk
+static int disk_fd = -1; // descriptor of disk, kept open for splicing reads
+
+/**
+ * How access times are maintained. Access times are never written into existing log
+ * entries: updates are kept in memory and persisted with the next entry for the inode.
+ */
+enum wfs_atime_mode {
+    ATIME_RELATIME,     // update when atime is older than mtime/ctime, or more than a day old
+    ATIME_STRICT,       // update on every access
+    ATIME_NOATIME,      // never update
+};
+
+#define RELATIME_INTERVAL (24 * 60 * 60)
+#define MAX_WRITE_SIZE (1 << 20)
+#define WBUF_SIZE (64 * 1024)
+#define CHECKPOINT_INTERVAL 30  // default seconds between checkpoints while the log is being appended to
+#define STATFS_BLOCK_SIZE 512
+
+static enum wfs_atime_mode atime_mode = ATIME_RELATIME;
+static int writeback_cache = 0; // 1 to gather small writes in memory before logging them
+static uint64_t slow_ns = 0;    // operations taking this long are logged with their phases, 0 for none
+static uint64_t summary_ns = 60 * 1000000000ULL; // period of the amplification summary, 0 for none
+static int profile = 0;         // 1 to count CPU events of every operation, with -o profile
+static time_t checkpoint_interval = CHECKPOINT_INTERVAL;
+
+/**
+ * The FUSE operations, with the parameter list of each and the arguments to forward.
+ * Every operation is called through a wrapper that holds wfs_lock and records its statistics.
+ */
+#define WFS_OPS(X) \
+    X(GETATTR,   getattr,   (const char *path, struct stat *stbuf), (path, stbuf)) \
+    X(STATFS,    statfs,    (const char *path, struct statvfs *stbuf), (path, stbuf)) \
+    X(MKNOD,     mknod,     (const char *path, mode_t mode, dev_t dev), (path, mode, dev)) \
+    X(MKDIR,     mkdir,     (const char *path, mode_t mode), (path, mode)) \
+    X(READ,      read,      (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi), \
+                            (path, buf, size, offset, fi)) \
+    X(WRITE,     write,     (const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi), \
+                            (path, buf, size, offset, fi)) \
+    X(READDIR,   readdir,   (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi), \
+                            (path, buf, filler, offset, fi)) \
+    X(UNLINK,    unlink,    (const char *path), (path)) \
+    X(RMDIR,     rmdir,     (const char *path), (path)) \
+    X(READ_BUF,  read_buf,  (const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi), \
+                            (path, bufp, size, offset, fi)) \
+    X(WRITE_BUF, write_buf, (const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi), \
+                            (path, buf, offset, fi)) \
+    X(RENAME,    rename,    (const char *path, const char *to), (path, to)) \
+    X(CHMOD,     chmod,     (const char *path, mode_t mode), (path, mode)) \
+    X(CHOWN,     chown,     (const char *path, uid_t uid, gid_t gid), (path, uid, gid)) \
+    X(UTIMENS,   utimens,   (const char *path, const struct timespec tv[2]), (path, tv)) \
+    X(TRUNCATE,  truncate,  (const char *path, off_t size), (path, size)) \
+    X(FTRUNCATE, ftruncate, (const char *path, off_t size, struct fuse_file_info *fi), (path, size, fi)) \
+    X(FALLOCATE, fallocate, (const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi), \
+                            (path, mode, offset, length, fi)) \
+    X(CREATE,    create,    (const char *path, mode_t mode, struct fuse_file_info *fi), (path, mode, fi)) \
+    X(OPEN,      open,      (const char *path, struct fuse_file_info *fi), (path, fi)) \
+    X(FLUSH,     flush,     (const char *path, struct fuse_file_info *fi), (path, fi)) \
+    X(FSYNC,     fsync,     (const char *path, int datasync, struct fuse_file_info *fi), (path, datasync, fi)) \
+    X(RELEASE,   release,   (const char *path, struct fuse_file_info *fi), (path, fi)) \
+    X(IOCTL,     ioctl,     (const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data), \
+                            (path, cmd, arg, fi, flags, data))
+
+enum wfs_op {
+#define X(id, name, params, args) OP_##id,
+    WFS_OPS(X)
+#undef X
+    OP_COUNT
+};
+
+static const char *op_names[OP_COUNT] = {
+#define X(id, name, params, args) #name,
+    WFS_OPS(X)
+#undef X
+};
+
+/**
+ * Event counters, next to the per-operation statistics.
+ */
+enum wfs_counter {
+    CTR_LOG_APPENDED,   // bytes committed to the log
+    CTR_LOG_INDEXED,    // bytes of log entries indexed into the inode map
+    CTR_DIR_SCANNED,    // bytes of directory entries compared by lookups
+    CTR_DCACHE_HITS,    // path components resolved by the directory entry cache
+    CTR_DCACHE_MISSES,  // path components resolved by scanning the directory
+    CTR_SLOW_OPS,       // operations that took longer than slow_ns
+    CTR_USER_WRITTEN,   // bytes written by users
+    CTR_USER_READ,      // bytes returned to users by reads
+    CTR_READ_TOUCHED,   // bytes of the log read to serve those reads, metadata included
+    CTR_COUNT
+};
+
+static const char *counter_names[CTR_COUNT] = {
+    "log_appended_bytes", "log_indexed_bytes", "dir_scanned_bytes", "dcache_hits", "dcache_misses", "slow_ops",
+    "user_written_bytes", "user_read_bytes", "read_touched_bytes",
+};
+
+/**
+ * Phases of an operation timed for the slow operation log. Phases nest: path resolution
+ * includes the inode lookups it makes, and flushes include building and appending entries.
+ */
+enum wfs_phase {
+    PHASE_RESOLVE,      // path resolution, read_path()
+    PHASE_LOOKUP,       // inode lookups, read_inumber()
+    PHASE_BUILD,        // building new log entries: copying data and directory entries
+    PHASE_APPEND,       // committing entries to the log
+    PHASE_FLUSH,        // writing out write-back buffers and syncing the disk
+    PHASE_COUNT
+};
+
+static const char *phase_names[PHASE_COUNT] = { "resolve", "lookup", "build", "append", "flush" };
+
+/**
+ * CPU events counted for each operation with -o profile, in user space only, so that
+ * profiling works without privileges. Events the CPU or the kernel does not support, as in
+ * many virtual machines, are left out.
+ */
+enum wfs_prof_event {
+    PROF_CYCLES,
+    PROF_INSTRUCTIONS,
+    PROF_CACHE_MISSES,
+    PROF_PAGE_FAULTS,
+    PROF_COUNT
+};
+
+static const char *prof_names[PROF_COUNT] = { "cycles", "instructions", "cache_misses", "page_faults" };
+static const struct { uint32_t type; uint64_t config; } prof_events[PROF_COUNT] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+/**
+ * Latencies are kept in log-linear histograms: values below HIST_SUB have a bucket each, and
+ * every power of two above that is split into HIST_SUB buckets, so a bucket is never wider
+ * than 1/HIST_SUB of the values in it.
+ */
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 36    // latencies of 2^36 ns (about 69 s) and up share the last bucket
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+#define STATS_SHARDS 32
+
+struct wfs_op_stats {
+    uint64_t calls;
+    uint64_t errors;            // calls that returned a negative errno
+    uint64_t total_ns;
+    uint64_t hist[HIST_BUCKETS];
+    uint64_t profiled;          // calls whose CPU events were counted
+    uint64_t prof[PROF_COUNT];  // CPU events of those calls
+};
+
+/**
+ * Statistics are sharded by CPU, so threads on different CPUs do not contend for the same
+ * cache lines, and are summed over the shards when they are reported.
+ */
+struct wfs_stats_shard {
+    struct wfs_op_stats ops[OP_COUNT];
+    uint64_t counters[CTR_COUNT];
+} __attribute__((aligned(64)));
+
+static struct wfs_stats_shard stats[STATS_SHARDS];
+
+static struct wfs_stats_shard *stats_shard() {
+    int cpu = sched_getcpu();
+    return &stats[(cpu < 0 ? 0 : cpu) % STATS_SHARDS];
+}
+
+static void stats_add(enum wfs_counter counter, uint64_t n) {
+    __atomic_fetch_add(&stats_shard()->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Sums the counters of all shards.
+ *
+ * Parameters:
+ *  counters (uint64_t*): set to the value of each counter, CTR_COUNT of them.
+*/
+static void counters_sum(uint64_t *counters) {
+    memset(counters, 0, CTR_COUNT * sizeof(*counters));
+    for (int shard = 0; shard < STATS_SHARDS; shard++) {
+        for (int counter = 0; counter < CTR_COUNT; counter++)
+            counters[counter] += __atomic_load_n(&stats[shard].counters[counter], __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Gets an amplification factor: bytes of the log per byte of user data.
+*/
+static double amplification(uint64_t log_bytes, uint64_t user_bytes) {
+    return user_bytes ? (double)log_bytes / user_bytes : 0;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int hist_bucket(uint64_t value) {
+    if (value < HIST_SUB) return value;
+    int msb = 63 - __builtin_clzll(value);
+    int bucket = (msb - HIST_SUB_BITS + 1) * HIST_SUB + ((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    return (bucket < HIST_BUCKETS) ? bucket : HIST_BUCKETS - 1;
+}
+
+/**
+ * Gets the smallest value that falls in a histogram bucket.
+*/
+static uint64_t hist_lower(int bucket) {
+    if (bucket < HIST_SUB) return bucket;
+    return (uint64_t)(HIST_SUB + bucket % HIST_SUB) << (bucket / HIST_SUB - 1);
+}
+
+/**
+ * Gets the largest value that falls in a histogram bucket, other than the last one.
+*/
+static uint64_t hist_upper(int bucket) {
+    return (bucket + 1 < HIST_BUCKETS) ? hist_lower(bucket + 1) - 1 : hist_lower(bucket);
+}
+
+/**
+ * Op tracer. Every thread records its operations into a ring of its own, so recording an
+ * event takes no locks and shares no cache lines. The rings of all threads are kept in a
+ * list, and rings of threads that exited are taken over by new threads.
+ */
+#define TRACE_RING_EVENTS 4096  // events kept per thread, a power of two
+
+struct wfs_trace_ring {
+    struct wfs_trace_ring *next;
+    int in_use;                 // 1 while a thread owns the ring
+    uint32_t tid;
+    uint64_t head;              // number of events recorded by the owner
+    struct wfs_trace_event events[TRACE_RING_EVENTS];
+};
+
+static struct wfs_trace_ring *trace_rings = NULL;
+static __thread struct wfs_trace_ring *trace_ring = NULL;
+static pthread_key_t trace_key;                 // releases the ring of a thread at exit
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+static char trace_path[PATH_MAX];               // where SIGUSR1 dumps the trace
+
+static void trace_ring_release(void *ring) {
+    __atomic_store_n(&((struct wfs_trace_ring *)ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void trace_key_create() {
+    pthread_key_create(&trace_key, trace_ring_release);
+}
+
+/**
+ * Gets the ring of the calling thread, setting it up on the first call.
+ *
+ * Returns:
+ *  wfs_trace_ring*: the ring, or NULL if there is no memory for it.
+*/
+static struct wfs_trace_ring *trace_ring_get() {
+    if (trace_ring != NULL) return trace_ring;
+
+    struct wfs_trace_ring *ring;
+    for (ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        int free_ring = 0;
+        if (__atomic_compare_exchange_n(&ring->in_use, &free_ring, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&ring->head, 0, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(*ring));
+        if (ring == NULL) return NULL;
+        ring->in_use = 1;
+        ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    ring->tid = syscall(SYS_gettid);
+
+    pthread_once(&trace_key_once, trace_key_create);
+    pthread_setspecific(trace_key, ring);
+    trace_ring = ring;
+    return ring;
+}
+
+/**
+ * Writes a trace dump, through a function that writes out a buffer. Rings are not stopped
+ * while they are dumped, so the events being recorded meanwhile may come out torn.
+ *
+ * Parameters:
+ *  write_fn (function): writes len bytes of buf to ctx.
+ *  ctx (void*): passed to write_fn.
+*/
+static void trace_dump(void (*write_fn)(void *ctx, const void *buf, size_t len), void *ctx) {
+    struct wfs_trace_header header = { WFS_TRACE_MAGIC, OP_COUNT };
+    write_fn(ctx, &header, sizeof(header));
+    for (int op = 0; op < OP_COUNT; op++) {
+        char name[WFS_TRACE_OP_NAME_LEN] = {0};
+        strncpy(name, op_names[op], WFS_TRACE_OP_NAME_LEN - 1);
+        write_fn(ctx, name, sizeof(name));
+    }
+
+    for (struct wfs_trace_ring *ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t first = (head > TRACE_RING_EVENTS) ? head - TRACE_RING_EVENTS : 0;
+        struct wfs_trace_thread thread = { ring->tid, head - first };
+        write_fn(ctx, &thread, sizeof(thread));
+
+        // The events from the oldest one to the end of the ring, then from its start
+        size_t start = first & (TRACE_RING_EVENTS - 1);
+        size_t tail = (head - first < TRACE_RING_EVENTS - start) ? head - first : TRACE_RING_EVENTS - start;
+        write_fn(ctx, &ring->events[start], tail * sizeof(struct wfs_trace_event));
+        write_fn(ctx, &ring->events[0], (head - first - tail) * sizeof(struct wfs_trace_event));
+    }
+}
+
+static void trace_write_fd(void *ctx, const void *buf, size_t len) {
+    int fd = *(int *)ctx;
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0) return;
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+}
+
+static void trace_write_file(void *ctx, const void *buf, size_t len) {
+    fwrite(buf, 1, len, (FILE *)ctx);
+}
+
+/**
+ * Dumps the trace into trace_path on SIGUSR1. Only async-signal-safe calls are made.
+*/
+static void trace_signal(int sig) {
+    int saved_errno = errno;
+    int fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd != -1) {
+        trace_dump(trace_write_fd, &fd);
+        close(fd);
+    }
+    errno = saved_errno;
+}
+
+static void trace_report(FILE *out) {
+    trace_dump(trace_write_file, out);
+}
+
+/**
+ * Logs the write and read amplification since the last summary, once every summary_ns.
+ * Nothing is logged for periods without reads or writes.
+ *
+ * Parameters:
+ *  now (uint64_t): the current time.
+*/
+static void amp_summary(uint64_t now) {
+    static uint64_t last_ns = 0;
+    static uint64_t last[CTR_COUNT];
+
+    // Only one thread logs each summary
+    uint64_t then = __atomic_load_n(&last_ns, __ATOMIC_RELAXED);
+    if (now - then < summary_ns) return;
+    if (!__atomic_compare_exchange_n(&last_ns, &then, now, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) return;
+
+    uint64_t counters[CTR_COUNT];
+    counters_sum(counters);
+    uint64_t written = counters[CTR_USER_WRITTEN] - last[CTR_USER_WRITTEN];
+    uint64_t appended = counters[CTR_LOG_APPENDED] - last[CTR_LOG_APPENDED];
+    uint64_t read = counters[CTR_USER_READ] - last[CTR_USER_READ];
+    uint64_t touched = counters[CTR_READ_TOUCHED] - last[CTR_READ_TOUCHED];
+    memcpy(last, counters, sizeof(last));
+    if (written == 0 && read == 0) return;
+
+    syslog(LOG_INFO, "amplification write=%.2f (user=%luB log=%luB) read=%.2f (returned=%luB touched=%luB) "
+           "total write=%.2f read=%.2f", amplification(appended, written), (ulong)written, (ulong)appended,
+           amplification(touched, read), (ulong)read, (ulong)touched,
+           amplification(counters[CTR_LOG_APPENDED], counters[CTR_USER_WRITTEN]),
+           amplification(counters[CTR_READ_TOUCHED], counters[CTR_USER_READ]));
+}
+
+/**
+ * Access heatmap of the disk: bytes of the log read and written in each bucket of
+ * HEAT_BUCKET_SIZE bytes. Counts decay, halving every heat_half_life seconds, so they show
+ * where recent accesses went. Operations run one at a time, so the counts are plain.
+ */
+#define HEAT_BUCKET_SIZE (16 * 1024)
+#define HEAT_BUCKETS ((DISK_SIZE + HEAT_BUCKET_SIZE - 1) / HEAT_BUCKET_SIZE)
+#define HEAT_HALF_LIFE 60   // default seconds for the counts to halve
+
+static struct wfs_heat_bucket heat[HEAT_BUCKETS];
+static time_t heat_half_life = HEAT_HALF_LIFE;
+static time_t heat_epoch = 0;   // time the counts were last halved, 0 before the first access
+
+/**
+ * Halves the counts once for every half-life gone by since they were last halved.
+*/
+static void heat_decay() {
+    time_t now = time(NULL);
+    if (heat_epoch == 0) heat_epoch = now;
+    time_t periods = (now - heat_epoch) / heat_half_life;
+    if (periods <= 0) return;
+
+    heat_epoch += periods * heat_half_life;
+    int shift = (periods < 64) ? periods : 63;
+    for (size_t bucket = 0; bucket < HEAT_BUCKETS; bucket++) {
+        heat[bucket].read >>= shift;
+        heat[bucket].written >>= shift;
+    }
+}
+
+/**
+ * Records an access to a range of the disk.
+ *
+ * Parameters:
+ *  start (const char*): the first byte accessed, in the mapped disk.
+ *  len (size_t): number of bytes accessed.
+ *  written (int): 1 for a write, 0 for a read.
+*/
+static void heat_record(const char *start, size_t len, int written) {
+    if (len == 0) return;
+    heat_decay();
+    size_t offset = start - mapped_disk;
+    while (len > 0) {
+        size_t bucket = offset / HEAT_BUCKET_SIZE;
+        if (bucket >= HEAT_BUCKETS) return;
+        size_t n = (bucket + 1) * HEAT_BUCKET_SIZE - offset;
+        if (n > len) n = len;
+        if (written) heat[bucket].written += n;
+        else heat[bucket].read += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+/**
+ * Gets the bytes of the buckets read since the counts last decayed to nothing: an estimate
+ * of how much of the disk the page cache has to hold for reads to stay in memory.
+*/
+static uint64_t heat_read_set() {
+    uint64_t bytes = 0;
+    for (size_t bucket = 0; bucket < HEAT_BUCKETS; bucket++)
+        if (heat[bucket].read != 0) bytes += HEAT_BUCKET_SIZE;
+    return bytes;
+}
+
+/**
+ * Writes a heatmap dump, for stat.wfs.
+*/
+static void heat_report(FILE *out) {
+    heat_decay();
+    struct wfs_heat_header header = { WFS_HEAT_MAGIC, HEAT_BUCKET_SIZE, HEAT_BUCKETS, heat_half_life };
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(heat, sizeof(heat[0]), HEAT_BUCKETS, out);
+}
+
+/**
+ * Counters of the CPU events of a thread, opened as one perf event group so that they are
+ * all read with a single call. Groups are opened by each thread on its first operation and
+ * closed when it exits.
+ */
+struct wfs_prof_group {
+    int fds[PROF_COUNT];
+    int nevents;                    // events in the group
+    int events[PROF_COUNT];         // event of each value read from the group, in order
+};
+
+static __thread struct wfs_prof_group *prof_group = NULL;
+static __thread int prof_failed = 0;        // 1 if the group of the thread could not be opened
+static pthread_key_t prof_key;              // closes the group of a thread at exit
+static pthread_once_t prof_key_once = PTHREAD_ONCE_INIT;
+static uint32_t prof_available = 0;         // bit of every event counted by some thread
+
+static void prof_group_close(void *data) {
+    struct wfs_prof_group *group = data;
+    for (int i = 0; i < group->nevents; i++)
+        close(group->fds[i]);
+    free(group);
+}
+
+static void prof_key_create() {
+    pthread_key_create(&prof_key, prof_group_close);
+}
+
+/**
+ * Gets the event group of the calling thread, opening it on the first call.
+ *
+ * Returns:
+ *  wfs_prof_group*: the group, or NULL if no event could be opened.
+*/
+static struct wfs_prof_group *prof_group_get() {
+    if (prof_group != NULL || prof_failed) return prof_group;
+
+    struct wfs_prof_group *group = calloc(1, sizeof(*group));
+    if (group == NULL) {
+        prof_failed = 1;
+        return NULL;
+    }
+    for (int event = 0; event < PROF_COUNT; event++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = prof_events[event].type;
+        attr.config = prof_events[event].config;
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.disabled = (group->nevents == 0);
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        int leader = group->nevents ? group->fds[0] : -1;
+        int fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+        if (fd == -1) continue;
+        group->fds[group->nevents] = fd;
+        group->events[group->nevents++] = event;
+        __atomic_fetch_or(&prof_available, 1U << event, __ATOMIC_RELAXED);
+    }
+    if (group->nevents == 0) {
+        syslog(LOG_WARNING, "profile: no CPU events could be opened: %s", strerror(errno));
+        free(group);
+        prof_failed = 1;
+        return NULL;
+    }
+    ioctl(group->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+    pthread_once(&prof_key_once, prof_key_create);
+    pthread_setspecific(prof_key, group);
+    prof_group = group;
+    return group;
+}
+
+/**
+ * Reads the CPU events of the calling thread so far.
+ *
+ * Parameters:
+ *  values (uint64_t*): set to the count of each event, PROF_COUNT of them.
+ *
+ * Returns:
+ *  int: 0 on success, -1 if the events could not be read.
+*/
+static int prof_read(uint64_t *values) {
+    struct wfs_prof_group *group = prof_group_get();
+    if (group == NULL) return -1;
+    uint64_t data[1 + PROF_COUNT];
+    if (read(group->fds[0], data, sizeof(data)) < (ssize_t)((1 + group->nevents) * sizeof(uint64_t))) return -1;
+    memset(values, 0, PROF_COUNT * sizeof(*values));
+    for (int i = 0; i < group->nevents; i++)
+        values[group->events[i]] = data[1 + i];
+    return 0;
+}
+
+/**
+ * An operation in progress, from op_begin() to op_end(). Operations note what they work on
+ * in the scope of the calling thread, for the trace.
+ */
+struct wfs_op_scope {
+    enum wfs_op op;
+    const char *path;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint32_t inode_number;
+    uint64_t offset;
+    uint32_t size;
+    uint32_t appended;      // bytes committed to the log
+    uint64_t scanned;       // bytes of log entries and directory entries scanned
+    uint64_t phase_ns[PHASE_COUNT]; // only timed with a slow operation threshold
+    int profiled;                   // 1 if prof_start holds the CPU events at the start
+    uint64_t prof_start[PROF_COUNT];
+};
+
+static __thread struct wfs_op_scope *op_current = NULL;
+
+static void op_begin(struct wfs_op_scope *scope, enum wfs_op op, const char *path) {
+    scope->op = op;
+    scope->path = path;
+    scope->inode_number = WFS_TRACE_NO_INODE;
+    scope->offset = 0;
+    scope->size = 0;
+    scope->appended = 0;
+    scope->scanned = 0;
+    memset(scope->phase_ns, 0, sizeof(scope->phase_ns));
+    op_current = scope;
+    WFS_PROBE1(op__entry, op_names[op]);
+    scope->profiled = profile && prof_read(scope->prof_start) == 0;
+    scope->start_ns = now_ns();
+}
+
+static void op_note_inode(ulong inode_number) {
+    if (op_current != NULL) op_current->inode_number = inode_number;
+}
+
+static void op_note_range(off_t offset, size_t size) {
+    if (op_current == NULL) return;
+    op_current->offset = offset;
+    op_current->size = size;
+}
+
+static void op_note_scanned(size_t bytes) {
+    if (op_current != NULL) op_current->scanned += bytes;
+}
+
+/**
+ * Starts timing a phase of the current operation.
+ *
+ * Returns:
+ *  uint64_t: the start of the phase, for phase_end(), or 0 if phases are not timed.
+*/
+static uint64_t phase_begin() {
+    return (slow_ns != 0 && op_current != NULL) ? now_ns() : 0;
+}
+
+static void phase_end(enum wfs_phase phase, uint64_t start_ns) {
+    if (start_ns != 0 && op_current != NULL)
+        op_current->phase_ns[phase] += now_ns() - start_ns;
+}
+
+/**
+ * Logs an operation that took longer than slow_ns, with the time spent in each phase.
+*/
+static void op_log_slow(const struct wfs_op_scope *scope, uint64_t ns) {
+    char phases[PHASE_COUNT * 32] = "";
+    size_t len = 0;
+    for (int phase = 0; phase < PHASE_COUNT; phase++)
+        len += snprintf(phases + len, sizeof(phases) - len, " %s=%luus", phase_names[phase],
+                        (ulong)(scope->phase_ns[phase] / 1000));
+
+    char inode[16] = "-";
+    if (scope->inode_number != WFS_TRACE_NO_INODE)
+        snprintf(inode, sizeof(inode), "%u", scope->inode_number);
+    syslog(LOG_WARNING, "slow %s %luus path=%s inode=%s%s scanned=%luB appended=%uB", op_names[scope->op],
+           (ulong)(ns / 1000), scope->path ? scope->path : "-", inode, phases, (ulong)scope->scanned, scope->appended);
+}
+
+/**
+ * Records the statistics and the trace event of a finished operation.
+ *
+ * Returns:
+ *  int: ret, the result of the operation.
+*/
+static int op_end(struct wfs_op_scope *scope, int ret) {
+    uint64_t end_ns = now_ns();
+    uint64_t prof_end[PROF_COUNT];
+    int profiled = scope->profiled && prof_read(prof_end) == 0;
+    uint64_t ns = end_ns - scope->start_ns;
+    scope->end_ns = end_ns;
+    op_current = NULL;
+    if (slow_ns != 0 && ns >= slow_ns) {
+        stats_add(CTR_SLOW_OPS, 1);
+        op_log_slow(scope, ns);
+    }
+    if (summary_ns != 0)
+        amp_summary(end_ns);
+    WFS_PROBE4(op__return, op_names[scope->op], ret, scope->inode_number, ns);
+
+    struct wfs_trace_ring *ring = trace_ring_get();
+    if (ring != NULL) {
+        uint64_t head = ring->head;
+        struct wfs_trace_event *event = &ring->events[head & (TRACE_RING_EVENTS - 1)];
+        event->start_ns = scope->start_ns;
+        event->end_ns = end_ns;
+        event->offset = scope->offset;
+        event->inode_number = scope->inode_number;
+        event->size = scope->size;
+        event->appended = scope->appended;
+        event->error = (ret < 0) ? ret : 0;
+        event->op = scope->op;
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    }
+
+    struct wfs_op_stats *op = &stats_shard()->ops[scope->op];
+    __atomic_fetch_add(&op->calls, 1, __ATOMIC_RELAXED);
+    if (ret < 0)
+        __atomic_fetch_add(&op->errors, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&op->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&op->hist[hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+    if (profiled) {
+        __atomic_fetch_add(&op->profiled, 1, __ATOMIC_RELAXED);
+        for (int event = 0; event < PROF_COUNT; event++)
+            __atomic_fetch_add(&op->prof[event], prof_end[event] - scope->prof_start[event], __ATOMIC_RELAXED);
+    }
+    return ret;
+}
 
 /**
  * Given a path, gets the basename (name of the file or directory), and the path to the
@@ -41,524 +729,2447 @@ int parsepath(char* basename, char* dirname, const char* path) {
 }
 
 /**
- * Finds the largest inode number in the disk.
- * 
+ * FUSE runs operations on several threads unless mounted with -s. The inode map and the
+ * directory entry cache below, like all the in-memory state of the mount and the head of
+ * the log, are shared by all of them, so operations run one at a time, each holding
+ * wfs_lock.
+ */
+static pthread_mutex_t wfs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Write-back buffer of a file. With -o writeback_cache, small writes are gathered here and
+ * appended to the log as a single new version of the file, rather than one version per
+ * write. Holds one contiguous range of the file.
+ */
+struct wfs_wbuf {
+    off_t offset;           // offset in the file of the first buffered byte
+    size_t len;             // number of buffered bytes
+    uint mtime;             // time of the last buffered write
+    char data[WBUF_SIZE];
+};
+
+/**
+ * In-memory inode map. Maps an inode number to the offset of its latest log entry, so
+ * lookups do not have to scan the log. The log is append-only, so the map is brought up
+ * to date by indexing only the entries appended since the last sync.
+ */
+struct wfs_imap_slot {
+    uint32_t entry;         // offset of the latest log entry, 0 if none
+    uint32_t data;          // offset of the latest log entry holding the data, 0 if none
+    struct wfs_data_use use; // how much of that entry's data is in use by the file
+    uint32_t atime;         // access time not yet persisted in the log, 0 if none
+    uint32_t open_entry;    // latest log entry when the file was last opened, 0 if never
+    struct wfs_wbuf *wbuf;  // writes not yet appended to the log, NULL if none
+    uint64_t user_written;  // bytes written by users since the mount
+    uint64_t log_appended;  // bytes of log entries of the inode appended since the mount
+    uint64_t user_read;     // bytes returned to users by reads since the mount
+    uint64_t read_touched;  // bytes of the log read to serve those reads
+    uint32_t versions;      // number of log entries of the inode
+};
+
+static struct wfs_imap_slot *imap = NULL;           // indexed by inode number
+static ulong imap_len = 0;                          // number of slots in imap
+static ulong imap_max_inumber = 0;                  // largest inode number seen in the log
+static uint32_t imap_head = sizeof(struct wfs_sb);  // log offset indexed so far
+
+/**
+ * Space accounting of the log, kept up to date as entries are indexed. Entries before
+ * counted_head are already accounted for, by the checkpoint the counters were loaded from.
+ */
+static uint32_t live_bytes = 0;
+static uint32_t dead_bytes = 0;
+static uint32_t live_inodes = 0;
+static uint32_t counted_head = sizeof(struct wfs_sb);
+static time_t checkpoint_time = 0;  // time the last checkpoint was written
+
+/**
+ * Moves a log entry that is no longer the latest for its inode from live to dead bytes.
+*/
+static void account_superseded(uint32_t offset) {
+    size_t len = wfs_entry_len((struct wfs_log_entry *)(mapped_disk + offset));
+    live_bytes -= len;
+    dead_bytes += len;
+}
+
+/**
+ * Accounts for a new log entry, and for the entries of the inode it supersedes. A tombstone
+ * supersedes all entries of the inode, and is dead itself.
+ *
+ * Parameters:
+ *  entry (struct wfs_log_entry*): the new entry.
+ *  slot (struct wfs_imap_slot*): slot of the inode, before it is updated for the entry.
+*/
+static void account_entry(const struct wfs_log_entry *entry, const struct wfs_imap_slot *slot) {
+    if (slot->entry == 0)
+        live_inodes++;
+    // The latest attributes are superseded unless they are those of the latest data entry,
+    // which only a new data entry supersedes
+    if (slot->entry != 0 && slot->entry != slot->data)
+        account_superseded(slot->entry);
+    if ((entry->inode.flags == WFS_ENTRY_INODE || entry->inode.flags == WFS_ENTRY_TOMBSTONE) && slot->data != 0)
+        account_superseded(slot->data);
+    if (entry->inode.flags == WFS_ENTRY_TOMBSTONE) {
+        dead_bytes += wfs_entry_len(entry);
+        live_inodes--;
+    } else {
+        live_bytes += wfs_entry_len(entry);
+    }
+}
+
+/**
+ * Indexes the log entries between the last indexed offset and the head of the log.
+ *
+ * Returns:
+ *  int: 0 on success, -1 if the map could not be grown.
+*/
+static int imap_sync() {
+    struct wfs_sb *sb = (struct wfs_sb *)mapped_disk;
+    if (imap_head < sb->head) {
+        WFS_PROBE2(imap__sync, imap_head, sb->head);
+        stats_add(CTR_LOG_INDEXED, sb->head - imap_head);
+        op_note_scanned(sb->head - imap_head);
+    }
+
+    while (imap_head < sb->head) {
+        struct wfs_log_entry *current_entry = (struct wfs_log_entry *)(mapped_disk + imap_head);
+        ulong inode_number = current_entry->inode.inode_number;
+        if (inode_number >= imap_len) {
+            ulong new_len = imap_len ? imap_len : 64;
+            while (new_len <= inode_number) new_len *= 2;
+            struct wfs_imap_slot *new_imap = realloc(imap, new_len * sizeof(*imap));
+            if (new_imap == NULL) return -1;
+            memset(new_imap + imap_len, 0, (new_len - imap_len) * sizeof(*imap));
+            imap = new_imap;
+            imap_len = new_len;
+        }
+        if (imap_head >= counted_head)
+            account_entry(current_entry, &imap[inode_number]);
+
+        // New entries carry their own access time, superseding any cached one
+        imap[inode_number].entry = imap_head;
+        imap[inode_number].versions++;
+        if (current_entry->inode.flags == WFS_ENTRY_INODE)
+            imap[inode_number].data = imap_head;
+        else if (current_entry->inode.flags == WFS_ENTRY_TOMBSTONE)
+            imap[inode_number].data = 0;
+        wfs_data_use_apply(&imap[inode_number].use, current_entry);
+        imap[inode_number].atime = 0;
+        if (inode_number > imap_max_inumber)
+            imap_max_inumber = inode_number;
+        imap_head += wfs_entry_len(current_entry);
+    }
+
+    return 0;
+}
+
+/**
+ * Loads the space accounting from the checkpoint, if it is valid for this log. Must be
+ * called before the log is first indexed; otherwise the counters are rebuilt from the log.
+ * Disks formatted before the checkpoint existed may have a log reaching over its place,
+ * whose bytes are then log entries and not a checkpoint.
+*/
+static void load_checkpoint() {
+    struct wfs_sb *sb = (struct wfs_sb *)mapped_disk;
+    struct wfs_ckpt *checkpoint = (struct wfs_ckpt *)(mapped_disk + WFS_CKPT_OFFSET);
+
+    if (sb->head > WFS_CKPT_OFFSET) return;
+    if (checkpoint->magic != WFS_CKPT_MAGIC || checkpoint->head < sizeof(struct wfs_sb) || checkpoint->head > sb->head)
+        return;
+    live_bytes = checkpoint->live_bytes;
+    dead_bytes = checkpoint->dead_bytes;
+    live_inodes = checkpoint->inodes;
+    counted_head = checkpoint->head;
+}
+
+/**
+ * Writes the space accounting of the whole log into the checkpoint. Nothing is written if
+ * the checkpoint is already up to date, or if the log reaches over the place of the
+ * checkpoint, as it may on disks formatted before the checkpoint existed, until fsck.wfs
+ * compacts the log.
+ *
+ * Returns:
+ *  int: 0 on success, -1 if the log could not be indexed.
+*/
+static int write_checkpoint() {
+    if (imap_sync() != 0) return -1;
+    checkpoint_time = time(NULL);
+    if (imap_head > WFS_CKPT_OFFSET) return 0;
+
+    struct wfs_ckpt *checkpoint = (struct wfs_ckpt *)(mapped_disk + WFS_CKPT_OFFSET);
+    if (checkpoint->magic == WFS_CKPT_MAGIC && checkpoint->head == imap_head && checkpoint->live_bytes == live_bytes &&
+        checkpoint->dead_bytes == dead_bytes && checkpoint->inodes == live_inodes)
+        return 0;
+    checkpoint->magic = WFS_CKPT_MAGIC;
+    checkpoint->head = imap_head;
+    checkpoint->live_bytes = live_bytes;
+    checkpoint->dead_bytes = dead_bytes;
+    checkpoint->inodes = live_inodes;
+    WFS_PROBE3(checkpoint, imap_head, live_bytes, dead_bytes);
+    return 0;
+}
+
+/**
+ * Finds the largest inode number in the disk.
+ * 
+ * Returns:
+ *  ulong: the largest inode number in the disk.
+*/
+static ulong get_largest_inumber() {
+    imap_sync();
+    return imap_max_inumber;
+}
+
+/**
+ * Number of bytes reserved past the head of the log that are not yet committed.
+ */
+static size_t log_pending = 0;
+
+/**
+ * Reserves space for a new log entry past the head of the log. Entries are written in
+ * place in the reserved space, and only become part of the log once log_commit() moves
+ * the head past them, so several entries can be committed at once.
+ *
+ * Parameters:
+ *  len (size_t): size of the entry, including the inode.
+ *
+ * Returns:
+ *  char*: address of the reserved space, or NULL if the disk is full.
+*/
+static char *log_reserve(size_t len) {
+    struct wfs_sb *sb = (struct wfs_sb *)mapped_disk;
+    if (sb->head + log_pending + len > WFS_CKPT_OFFSET) return NULL;
+
+    char *entry = mapped_disk + sb->head + log_pending;
+    log_pending += len;
+    return entry;
+}
+
+/**
+ * Commits all reserved log entries by moving the head of the log past them.
+*/
+static void log_commit() {
+    uint64_t start = phase_begin();
+    WFS_PROBE2(log__append, ((struct wfs_sb *)mapped_disk)->head, log_pending);
+    stats_add(CTR_LOG_APPENDED, log_pending);
+    if (op_current != NULL) op_current->appended += log_pending;
+
+    char *entry = mapped_disk + ((struct wfs_sb *)mapped_disk)->head;
+    heat_record(entry, log_pending, 1);
+    ((struct wfs_sb *)mapped_disk)->head += log_pending;
+    log_pending = 0;
+
+    // Charge each entry to its inode, for the amplification of the inode. Indexing the
+    // entries first gives new inodes a slot.
+    imap_sync();
+    for (char *end = mapped_disk + ((struct wfs_sb *)mapped_disk)->head; entry < end; entry += wfs_entry_len((struct wfs_log_entry *)entry)) {
+        ulong inode_number = ((struct wfs_log_entry *)entry)->inode.inode_number;
+        if (inode_number < imap_len)
+            imap[inode_number].log_appended += wfs_entry_len((struct wfs_log_entry *)entry);
+    }
+
+    // Bound the part of the log a remount has to account for
+    if (time(NULL) - checkpoint_time >= checkpoint_interval)
+        write_checkpoint();
+    phase_end(PHASE_APPEND, start);
+}
+
+/**
+ * Drops all reserved log entries.
+*/
+static void log_abort() {
+    log_pending = 0;
+}
+
+/**
+ * Accounts for bytes of an inode written in place into space already in the log, such as
+ * space reserved by fallocate, which log_commit() does not see.
+ *
+ * Parameters:
+ *  inode_number (ulong): inode the bytes belong to.
+ *  start (const char*): the first byte written, in the mapped disk.
+ *  len (size_t): number of bytes written.
+*/
+static void log_written_in_place(ulong inode_number, const char *start, size_t len) {
+    stats_add(CTR_LOG_APPENDED, len);
+    if (op_current != NULL) op_current->appended += len;
+    heat_record(start, len, 1);
+    if (inode_number < imap_len)
+        imap[inode_number].log_appended += len;
+}
+
+/**
+ * Get the live inode associated with the given inode number.
+ * 
+ * Parameters:
+ *  inode_number (uint): inode number of the inode.
+ * 
+ * Returns:
+ *  wfs_inode*: pointer to inode structure associated with inode number, or NULL if there
+ *              is no such inode or it is deleted.
+*/
+static struct wfs_inode *read_inumber(uint inode_number) {
+    uint64_t start = phase_begin();
+    imap_sync();
+
+    struct wfs_inode *inode = NULL;
+    if (inode_number < imap_len && imap[inode_number].entry != 0) {
+        inode = (struct wfs_inode *)(mapped_disk + imap[inode_number].entry);
+        if (inode->flags == WFS_ENTRY_TOMBSTONE) inode = NULL;
+    }
+    phase_end(PHASE_LOOKUP, start);
+    return inode;
+}
+
+/**
+ * Gets the data of an inode. Entries that only update attributes carry no data, so the
+ * data lives in the latest full entry of the inode.
+ *
+ * Parameters:
+ *  inode (wfs_inode*): the latest entry of the inode.
+ *
+ * Returns:
+ *  char*: address of the data.
+*/
+static char *inode_data(struct wfs_inode *inode) {
+    return ((struct wfs_log_entry *)(mapped_disk + imap[inode->inode_number].data))->data;
+}
+
+/**
+ * Gets the number of bytes of data stored for an inode. Bytes of the file past them are
+ * a hole, and read as zeros.
+ *
+ * Parameters:
+ *  inode (wfs_inode*): the latest entry of the inode.
+ *
+ * Returns:
+ *  size_t: the number of bytes stored.
+*/
+static size_t inode_data_size(struct wfs_inode *inode) {
+    return imap[inode->inode_number].use.size;
+}
+
+/**
+ * Gets the access time of an inode, including an update not yet persisted in the log.
+ *
+ * Parameters:
+ *  inode (wfs_inode*): the latest entry of the inode.
+ *
+ * Returns:
+ *  uint: the access time.
+*/
+static uint inode_atime(struct wfs_inode *inode) {
+    if (inode->inode_number < imap_len && imap[inode->inode_number].atime > inode->atime)
+        return imap[inode->inode_number].atime;
+    return inode->atime;
+}
+
+/**
+ * Records an access to an inode according to the atime mode. The new access time only
+ * lives in memory until the next log entry for the inode is written, so reads never
+ * dirty the log.
+ *
+ * Parameters:
+ *  inode (wfs_inode*): the latest entry of the inode.
+*/
+static void touch_atime(struct wfs_inode *inode) {
+    if (atime_mode == ATIME_NOATIME || inode->inode_number >= imap_len) return;
+
+    uint now = time(NULL);
+    uint atime = inode_atime(inode);
+    if (atime_mode == ATIME_RELATIME && atime > inode->mtime && atime > inode->ctime
+        && now - atime < RELATIME_INTERVAL)
+        return;
+    imap[inode->inode_number].atime = now;
+}
+
+/**
+ * Accounts for user data written to an inode, for write amplification.
+*/
+static void account_write(ulong inode_number, size_t bytes) {
+    stats_add(CTR_USER_WRITTEN, bytes);
+    if (inode_number < imap_len)
+        imap[inode_number].user_written += bytes;
+}
+
+/**
+ * Accounts for a read of an inode, for read amplification.
+ *
+ * Parameters:
+ *  inode_number (ulong): the inode read.
+ *  returned (size_t): bytes returned to the user.
+ *  touched (size_t): bytes of file data read from the log; the inode and the log entries
+ *                    and directory entries scanned by the operation are added to them.
+*/
+static void account_read(ulong inode_number, size_t returned, size_t touched) {
+    touched += sizeof(struct wfs_inode) + ((op_current != NULL) ? op_current->scanned : 0);
+    stats_add(CTR_USER_READ, returned);
+    stats_add(CTR_READ_TOUCHED, touched);
+    if (inode_number < imap_len) {
+        imap[inode_number].user_read += returned;
+        imap[inode_number].read_touched += touched;
+    }
+}
+
+/**
+ * Directory entry cache. Remembers which inode a name in a directory resolved to, so
+ * repeated path walks (e.g. the getattr storm that follows a readdir) skip the linear
+ * dentry scan. An entry is tagged with the log offset of the directory version it was read
+ * from, and is ignored once the directory has been rewritten. Collisions overwrite.
+ */
+struct wfs_dcache_entry {
+    uint32_t parent_gen;            // log offset of the parent directory data, 0 if unused
+    ulong parent;                   // inode number of the parent directory
+    ulong child;                    // inode number the name resolved to
+    char name[MAX_FILE_NAME_LEN];
+};
+
+#define DCACHE_SIZE 65536           // default number of slots, must be a power of two
+
+static struct wfs_dcache_entry *dcache = NULL;
+static size_t dcache_size = DCACHE_SIZE;
+
+static size_t dcache_slot(ulong parent, const char *name) {
+    size_t hash = 14695981039346656037UL ^ parent;
+    for (const char *c = name; *c != '\0'; c++)
+        hash = (hash ^ (unsigned char)*c) * 1099511628211UL;
+    return hash & (dcache_size - 1);
+}
+
+/**
+ * Looks up a name in the directory entry cache.
+ *
+ * Parameters:
+ *  parent (ulong): inode number of the directory.
+ *  name (const char*): name of the entry.
+ *  child (ulong*): set to the inode number of the entry on a hit.
+ *
+ * Returns:
+ *  int: 1 on a hit, 0 otherwise.
+*/
+static int dcache_lookup(ulong parent, const char *name, ulong *child) {
+    if (dcache == NULL || parent >= imap_len) return 0;
+    struct wfs_dcache_entry *entry = &dcache[dcache_slot(parent, name)];
+    if (entry->parent_gen == 0 || entry->parent_gen != imap[parent].data || entry->parent != parent) return 0;
+    if (strncmp(entry->name, name, MAX_FILE_NAME_LEN)) return 0;
+    *child = entry->child;
+    return 1;
+}
+
+static void dcache_insert(ulong parent, const char *name, ulong child) {
+    imap_sync();
+    if (dcache == NULL) {
+        dcache = calloc(dcache_size, sizeof(*dcache));
+        if (dcache == NULL) return;
+    }
+    if (parent >= imap_len) return;
+    struct wfs_dcache_entry *entry = &dcache[dcache_slot(parent, name)];
+    entry->parent_gen = imap[parent].data;
+    entry->parent = parent;
+    entry->child = child;
+    strncpy(entry->name, name, MAX_FILE_NAME_LEN);
+}
+
+/**
+ * Empties the directory entry cache, optionally giving it a new number of slots. It is
+ * allocated again on the next insertion.
+ *
+ * Parameters:
+ *  size (size_t): the new number of slots, a power of two, or 0 to keep the current one.
+*/
+static void dcache_drop(size_t size) {
+    free(dcache);
+    dcache = NULL;
+    if (size != 0) dcache_size = size;
+}
+
+/**
+ * Get the live inode associated with a given path. Iterates over disk space.
+ * 
+ * Parameters:
+ *  path (const char*): the path, represented as a string.
+ * 
+ * Returns:
+ *  wfs_inode*: pointer to inode structure associated with path.
+*/
+static struct wfs_inode *walk_path(const char *path) {
+    // Start with the root inode number
+    ulong current_inode_number = 0;
+
+    // Make a copy of the path since strtok modifies the string
+    char path_copy[strlen(path) + 1];
+    strcpy(path_copy, path);
+
+    // Tokenize the path using '/'
+    char *token = strtok(path_copy, "/");
+    while (token != NULL) {
+        struct wfs_log_entry *latest_matching_entry = (struct wfs_log_entry *)read_inumber(current_inode_number);
+        if (latest_matching_entry == NULL || !S_ISDIR(latest_matching_entry->inode.mode)) return NULL;
+
+        ulong child_inode_number;
+        if (dcache_lookup(current_inode_number, token, &child_inode_number)) {
+            WFS_PROBE4(path__step, current_inode_number, token, child_inode_number, 0);
+            stats_add(CTR_DCACHE_HITS, 1);
+            current_inode_number = child_inode_number;
+            token = strtok(NULL, "/");
+            continue;
+        }
+
+        // Found the inode, return a pointer to it
+        int found = 0;
+        struct wfs_dentry *dir_entry = (struct wfs_dentry *)inode_data(&latest_matching_entry->inode);
+        int directory_offset = 0;
+        while (directory_offset < latest_matching_entry->inode.size) {
+            if (!strcmp(dir_entry->name, token)) {
+                found = 1;
+                WFS_PROBE4(path__step, current_inode_number, token, dir_entry->inode_number,
+                           directory_offset + sizeof(struct wfs_dentry));
+                dcache_insert(current_inode_number, token, dir_entry->inode_number);
+                current_inode_number = dir_entry->inode_number;
+                break;
+            }
+            // Move to the next directory entry
+            directory_offset += sizeof(struct wfs_dentry);
+            dir_entry++;
+        }
+        if (!found)
+            WFS_PROBE4(path__step, current_inode_number, token, -1L, directory_offset);
+        stats_add(CTR_DCACHE_MISSES, 1);
+        size_t scanned = found ? directory_offset + sizeof(struct wfs_dentry) : directory_offset;
+        stats_add(CTR_DIR_SCANNED, scanned);
+        op_note_scanned(scanned);
+        heat_record(inode_data(&latest_matching_entry->inode), scanned, 0);
+        if (!found)
+            return NULL;
+
+        // Get the next token
+        token = strtok(NULL, "/");
+    }
+
+    op_note_inode(current_inode_number);
+    return read_inumber(current_inode_number);
+}
+
+static struct wfs_inode *read_path(const char *path) {
+    uint64_t start = phase_begin();
+    struct wfs_inode *inode = walk_path(path);
+    phase_end(PHASE_RESOLVE, start);
+    return inode;
+}
+
+/**
+ * Gets the readdir cookie of a directory entry. Cookies must be non-zero, since an offset
+ * of 0 asks for the start of the directory.
+*/
+static off_t dentry_cookie(const struct wfs_dentry *dentry) {
+    return (off_t)dentry->inode_number + 1;
+}
+
+/**
+ * Fills a stat buffer with the attributes of an inode.
+ *
+ * Parameters:
+ *  inode (wfs_inode*): the inode to describe.
+ *  stbuf (stat*): the buffer to fill.
+*/
+static void fill_stat(struct wfs_inode *inode, struct stat *stbuf) {
+    stbuf->st_ino = inode->inode_number;
+    stbuf->st_uid = inode->uid;
+    stbuf->st_gid = inode->gid;
+    stbuf->st_atime = inode_atime(inode);
+    stbuf->st_mtime = inode->mtime;
+    stbuf->st_mode = inode->mode;
+    stbuf->st_nlink = inode->links;
+    stbuf->st_size = inode->size;
+
+    // Account for writes still sitting in the write-back buffer
+    struct wfs_wbuf *wbuf = (inode->inode_number < imap_len) ? imap[inode->inode_number].wbuf : NULL;
+    if (wbuf != NULL) {
+        if (wbuf->offset + wbuf->len > stbuf->st_size)
+            stbuf->st_size = wbuf->offset + wbuf->len;
+        // Unless attributes set since then gave the file a later one
+        if (wbuf->mtime > stbuf->st_mtime) stbuf->st_mtime = wbuf->mtime;
+    }
+}
+
+/**
+ * Gets the inode an operation refers to, preferring the file handle over the path.
+ *
+ * Parameters:
+ *  path (const char*): the path of the file or directory.
+ *  fi (fuse_file_info*): the file handle, may be NULL.
+ *  inode (wfs_inode**): set to the inode on success.
+ *
+ * Returns:
+ *  int: 0 on success, -EBADF or -ENOENT on failure.
+*/
+static int get_inode(const char *path, struct fuse_file_info *fi, struct wfs_inode **inode) {
+    if (fi && fi->fh) { // file handle provided, holding the inode number plus one
+        op_note_inode(fi->fh - 1);
+        *inode = read_inumber(fi->fh - 1);
+        if (*inode == NULL)
+            return -EBADF;
+    } else {
+        *inode = read_path(path);
+        if (*inode == NULL) return -ENOENT;
+    }
+    return 0;
+}
+
+/**
+ * Appends an attribute entry for an inode. It supersedes the attributes of the inode
+ * while its data stays where it is, so metadata updates cost a single inode in the log.
+ *
+ * Parameters:
+ *  attr (wfs_inode*): the new attributes of the inode.
+ *
+ * Returns:
+ *  int: 0 on success, or a negative errno on failure.
+*/
+static int write_attr(const struct wfs_inode *attr) {
+    struct wfs_log_entry *new_log = (struct wfs_log_entry *)log_reserve(sizeof(struct wfs_inode));
+    if (new_log == NULL) return -ENOSPC;
+
+    new_log->inode = *attr;
+    new_log->inode.flags = WFS_ENTRY_ATTR;
+    log_commit();
+    return 0;
+}
+
+/**
+ * Appends a fill entry for a file: an attribute entry that also sets how many bytes of the
+ * data in the latest full entry of the file are in use.
+ *
+ * Parameters:
+ *  attr (wfs_inode*): the new attributes of the file.
+ *  used (uint): number of bytes of data in use.
+ *  reserved (int): nonzero if the bytes past those in use are space reserved by fallocate,
+ *   never written, rather than a hole over older data.
+ *
+ * Returns:
+ *  int: 0 on success, or a negative errno on failure.
+*/
+static int write_fill(const struct wfs_inode *attr, uint used, int reserved) {
+    struct wfs_log_entry *new_log = (struct wfs_log_entry *)log_reserve(sizeof(struct wfs_inode) + sizeof(uint));
+    if (new_log == NULL) return -ENOSPC;
+
+    new_log->inode = *attr;
+    new_log->inode.flags = reserved ? WFS_ENTRY_RESERVE : WFS_ENTRY_FILL;
+    memcpy(new_log->data, &used, sizeof(uint));
+    log_commit();
+    return 0;
+}
+
+/**
+ * Sums the statistics of all shards.
+ *
+ * Parameters:
+ *  ops (wfs_op_stats*): set to the statistics of each operation, OP_COUNT of them.
+ *  counters (uint64_t*): set to the value of each counter, CTR_COUNT of them.
+*/
+static void stats_sum(struct wfs_op_stats *ops, uint64_t *counters) {
+    memset(ops, 0, OP_COUNT * sizeof(*ops));
+    counters_sum(counters);
+    for (int shard = 0; shard < STATS_SHARDS; shard++) {
+        for (int op = 0; op < OP_COUNT; op++) {
+            struct wfs_op_stats *from = &stats[shard].ops[op];
+            ops[op].calls += __atomic_load_n(&from->calls, __ATOMIC_RELAXED);
+            ops[op].errors += __atomic_load_n(&from->errors, __ATOMIC_RELAXED);
+            ops[op].total_ns += __atomic_load_n(&from->total_ns, __ATOMIC_RELAXED);
+            for (int bucket = 0; bucket < HIST_BUCKETS; bucket++)
+                ops[op].hist[bucket] += __atomic_load_n(&from->hist[bucket], __ATOMIC_RELAXED);
+            ops[op].profiled += __atomic_load_n(&from->profiled, __ATOMIC_RELAXED);
+            for (int event = 0; event < PROF_COUNT; event++)
+                ops[op].prof[event] += __atomic_load_n(&from->prof[event], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * Gets a latency percentile from a histogram, as the largest value of the bucket it is in.
+ *
+ * Parameters:
+ *  op (wfs_op_stats*): the statistics of an operation.
+ *  fraction (double): the percentile, between 0 and 1.
+*/
+static uint64_t stats_percentile(const struct wfs_op_stats *op, double fraction) {
+    if (op->calls == 0) return 0;
+    uint64_t rank = fraction * op->calls;
+    if (rank >= op->calls) rank = op->calls - 1;
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < HIST_BUCKETS; bucket++) {
+        seen += op->hist[bucket];
+        if (seen > rank) return hist_upper(bucket);
+    }
+    return hist_upper(HIST_BUCKETS - 1);
+}
+
+static const double stats_fractions[] = { 0.5, 0.9, 0.99, 0.999, 1.0 };
+static const char *stats_fraction_names[] = { "p50_ns", "p90_ns", "p99_ns", "p999_ns", "max_ns" };
+#define STATS_FRACTIONS (sizeof(stats_fractions) / sizeof(stats_fractions[0]))
+
+/**
+ * Gauges of the log, as name and value pairs.
+*/
+struct wfs_gauge {
+    const char *name;
+    uint64_t value;
+};
+
+#define STATS_GAUGES 7
+
+static int stats_gauges(struct wfs_gauge *gauges) {
+    imap_sync();
+    uint32_t head = ((struct wfs_sb *)mapped_disk)->head;
+    uint32_t checkpoint_head = ((struct wfs_ckpt *)(mapped_disk + WFS_CKPT_OFFSET))->head;
+    if (head > WFS_CKPT_OFFSET) checkpoint_head = 0; // the log of an old disk reaches over it
+    int n = 0;
+    gauges[n++] = (struct wfs_gauge){ "head", head };
+    gauges[n++] = (struct wfs_gauge){ "capacity_bytes", WFS_CKPT_OFFSET - sizeof(struct wfs_sb) };
+    gauges[n++] = (struct wfs_gauge){ "free_bytes", (head < WFS_CKPT_OFFSET) ? WFS_CKPT_OFFSET - head : 0 };
+    gauges[n++] = (struct wfs_gauge){ "live_bytes", live_bytes };
+    gauges[n++] = (struct wfs_gauge){ "dead_bytes", dead_bytes };
+    gauges[n++] = (struct wfs_gauge){ "inodes", live_inodes };
+    gauges[n++] = (struct wfs_gauge){ "checkpoint_head", checkpoint_head };
+    return n;
+}
+
+#define STATS_TOP_INODES 10
+
+/**
+ * Finds the inodes with the most bytes of some kind, such as log bytes appended.
+ *
+ * Parameters:
+ *  offset (size_t): offset of the uint64_t byte count in struct wfs_imap_slot.
+ *  top (ulong*): set to the inode numbers, most bytes first, STATS_TOP_INODES of them.
+ *
+ * Returns:
+ *  int: number of inodes found, those with no bytes left out.
+*/
+static int stats_top_inodes(size_t offset, ulong *top) {
+    int n = 0;
+    for (ulong inode_number = 0; inode_number < imap_len; inode_number++) {
+        uint64_t bytes = *(uint64_t *)((char *)&imap[inode_number] + offset);
+        if (bytes == 0) continue;
+        int pos = n;
+        while (pos > 0 && *(uint64_t *)((char *)&imap[top[pos - 1]] + offset) < bytes) pos--;
+        if (pos >= STATS_TOP_INODES) continue;
+        if (n < STATS_TOP_INODES) n++;
+        memmove(&top[pos + 1], &top[pos], (n - 1 - pos) * sizeof(ulong));
+        top[pos] = inode_number;
+    }
+    return n;
+}
+
+/**
+ * Writes the statistics as text: one "name value" line per gauge and counter, followed by
+ * a table of the operations that were called and the inodes with the most amplification.
+*/
+static void stats_report_text(FILE *out) {
+    struct wfs_gauge gauges[STATS_GAUGES];
+    int ngauges = stats_gauges(gauges);
+    for (int i = 0; i < ngauges; i++)
+        fprintf(out, "%s %lu\n", gauges[i].name, (ulong)gauges[i].value);
+
+    struct wfs_op_stats *ops = malloc(OP_COUNT * sizeof(*ops));
+    uint64_t counters[CTR_COUNT];
+    if (ops == NULL) return;
+    stats_sum(ops, counters);
+    for (int i = 0; i < CTR_COUNT; i++)
+        fprintf(out, "%s %lu\n", counter_names[i], (ulong)counters[i]);
+
+    fprintf(out, "\n%-10s %10s %8s %10s", "op", "calls", "errors", "avg_ns");
+    for (size_t i = 0; i < STATS_FRACTIONS; i++)
+        fprintf(out, " %10s", stats_fraction_names[i]);
+    fprintf(out, "\n");
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (ops[op].calls == 0) continue;
+        fprintf(out, "%-10s %10lu %8lu %10lu", op_names[op], (ulong)ops[op].calls, (ulong)ops[op].errors,
+                (ulong)(ops[op].total_ns / ops[op].calls));
+        for (size_t i = 0; i < STATS_FRACTIONS; i++)
+            fprintf(out, " %10lu", (ulong)stats_percentile(&ops[op], stats_fractions[i]));
+        fprintf(out, "\n");
+    }
+
+    // Average CPU events per call, for the events that could be counted
+    uint32_t available = __atomic_load_n(&prof_available, __ATOMIC_RELAXED);
+    if (available != 0) {
+        fprintf(out, "\n%-10s %10s", "op", "profiled");
+        for (int event = 0; event < PROF_COUNT; event++)
+            if (available & (1U << event)) fprintf(out, " %14s", prof_names[event]);
+        fprintf(out, "\n");
+        for (int op = 0; op < OP_COUNT; op++) {
+            if (ops[op].profiled == 0) continue;
+            fprintf(out, "%-10s %10lu", op_names[op], (ulong)ops[op].profiled);
+            for (int event = 0; event < PROF_COUNT; event++)
+                if (available & (1U << event)) fprintf(out, " %14.1f", (double)ops[op].prof[event] / ops[op].profiled);
+            fprintf(out, "\n");
+        }
+    }
+    free(ops);
+
+    fprintf(out, "\nwrite_amplification %.2f\nread_amplification %.2f\n",
+            amplification(counters[CTR_LOG_APPENDED], counters[CTR_USER_WRITTEN]),
+            amplification(counters[CTR_READ_TOUCHED], counters[CTR_USER_READ]));
+    ulong top[STATS_TOP_INODES];
+    int ntop = stats_top_inodes(offsetof(struct wfs_imap_slot, log_appended), top);
+    fprintf(out, "\n%-10s %14s %14s %8s\n", "inode", "user_written", "log_appended", "amp");
+    for (int i = 0; i < ntop; i++)
+        fprintf(out, "%-10lu %14lu %14lu %8.2f\n", top[i], (ulong)imap[top[i]].user_written,
+                (ulong)imap[top[i]].log_appended, amplification(imap[top[i]].log_appended, imap[top[i]].user_written));
+    ntop = stats_top_inodes(offsetof(struct wfs_imap_slot, read_touched), top);
+    fprintf(out, "\n%-10s %14s %14s %8s\n", "inode", "user_read", "read_touched", "amp");
+    for (int i = 0; i < ntop; i++)
+        fprintf(out, "%-10lu %14lu %14lu %8.2f\n", top[i], (ulong)imap[top[i]].user_read,
+                (ulong)imap[top[i]].read_touched, amplification(imap[top[i]].read_touched, imap[top[i]].user_read));
+
+    // Buckets of the heatmap that were accessed
+    heat_decay();
+    fprintf(out, "\nheat_bucket_size %d\nheat_half_life_s %ld\nheat_read_set_bytes %lu\n", HEAT_BUCKET_SIZE,
+            (long)heat_half_life, (ulong)heat_read_set());
+    fprintf(out, "\n%-10s %14s %14s\n", "offset", "read", "written");
+    for (size_t bucket = 0; bucket < HEAT_BUCKETS; bucket++) {
+        if (heat[bucket].read == 0 && heat[bucket].written == 0) continue;
+        fprintf(out, "%-10zu %14lu %14lu\n", bucket * HEAT_BUCKET_SIZE, (ulong)heat[bucket].read,
+                (ulong)heat[bucket].written);
+    }
+}
+
+/**
+ * Writes the statistics as JSON, with the non-empty buckets of the latency histogram of
+ * every operation as [lowest_ns, highest_ns, count] triples.
+*/
+static void stats_report_json(FILE *out) {
+    struct wfs_gauge gauges[STATS_GAUGES];
+    int ngauges = stats_gauges(gauges);
+    fprintf(out, "{\"log\":{");
+    for (int i = 0; i < ngauges; i++)
+        fprintf(out, "%s\"%s\":%lu", i ? "," : "", gauges[i].name, (ulong)gauges[i].value);
+
+    struct wfs_op_stats *ops = malloc(OP_COUNT * sizeof(*ops));
+    uint64_t counters[CTR_COUNT];
+    if (ops == NULL) {
+        fprintf(out, "}}\n");
+        return;
+    }
+    stats_sum(ops, counters);
+    fprintf(out, "},\"counters\":{");
+    for (int i = 0; i < CTR_COUNT; i++)
+        fprintf(out, "%s\"%s\":%lu", i ? "," : "", counter_names[i], (ulong)counters[i]);
+
+    // Average CPU events per call, for the events that could be counted
+    uint32_t available = __atomic_load_n(&prof_available, __ATOMIC_RELAXED);
+    fprintf(out, "},\"ops\":{");
+    for (int op = 0; op < OP_COUNT; op++) {
+        fprintf(out, "%s\"%s\":{\"calls\":%lu,\"errors\":%lu,\"total_ns\":%lu", op ? "," : "", op_names[op],
+                (ulong)ops[op].calls, (ulong)ops[op].errors, (ulong)ops[op].total_ns);
+        for (size_t i = 0; i < STATS_FRACTIONS; i++)
+            fprintf(out, ",\"%s\":%lu", stats_fraction_names[i], (ulong)stats_percentile(&ops[op], stats_fractions[i]));
+        fprintf(out, ",\"hist\":[");
+        int first = 1;
+        for (int bucket = 0; bucket < HIST_BUCKETS; bucket++) {
+            if (ops[op].hist[bucket] == 0) continue;
+            fprintf(out, "%s[%lu,%lu,%lu]", first ? "" : ",", (ulong)hist_lower(bucket), (ulong)hist_upper(bucket),
+                    (ulong)ops[op].hist[bucket]);
+            first = 0;
+        }
+        fprintf(out, "]");
+        if (ops[op].profiled != 0) {
+            fprintf(out, ",\"profile\":{\"calls\":%lu", (ulong)ops[op].profiled);
+            for (int event = 0; event < PROF_COUNT; event++)
+                if (available & (1U << event))
+                    fprintf(out, ",\"%s\":%.1f", prof_names[event], (double)ops[op].prof[event] / ops[op].profiled);
+            fprintf(out, "}");
+        }
+        fprintf(out, "}");
+    }
+    free(ops);
+
+    fprintf(out, "},\"amplification\":{\"write\":%.4f,\"read\":%.4f,\"top_written\":[",
+            amplification(counters[CTR_LOG_APPENDED], counters[CTR_USER_WRITTEN]),
+            amplification(counters[CTR_READ_TOUCHED], counters[CTR_USER_READ]));
+    ulong top[STATS_TOP_INODES];
+    int ntop = stats_top_inodes(offsetof(struct wfs_imap_slot, log_appended), top);
+    for (int i = 0; i < ntop; i++)
+        fprintf(out, "%s{\"inode\":%lu,\"user_written\":%lu,\"log_appended\":%lu}", i ? "," : "", top[i],
+                (ulong)imap[top[i]].user_written, (ulong)imap[top[i]].log_appended);
+    fprintf(out, "],\"top_read\":[");
+    ntop = stats_top_inodes(offsetof(struct wfs_imap_slot, read_touched), top);
+    for (int i = 0; i < ntop; i++)
+        fprintf(out, "%s{\"inode\":%lu,\"user_read\":%lu,\"read_touched\":%lu}", i ? "," : "", top[i],
+                (ulong)imap[top[i]].user_read, (ulong)imap[top[i]].read_touched);
+
+    heat_decay();
+    fprintf(out, "]},\"heatmap\":{\"bucket_size\":%d,\"half_life_s\":%ld,\"read_set_bytes\":%lu,\"buckets\":[",
+            HEAT_BUCKET_SIZE, (long)heat_half_life, (ulong)heat_read_set());
+    int first = 1;
+    for (size_t bucket = 0; bucket < HEAT_BUCKETS; bucket++) {
+        if (heat[bucket].read == 0 && heat[bucket].written == 0) continue;
+        fprintf(out, "%s[%zu,%lu,%lu]", first ? "" : ",", bucket * HEAT_BUCKET_SIZE, (ulong)heat[bucket].read,
+                (ulong)heat[bucket].written);
+        first = 0;
+    }
+    fprintf(out, "]}}\n");
+}
+
+/**
+ * Hidden control directory. It is not part of the log and is left out of listings of the
+ * root directory; its files are read-only, and are generated when they are opened. The
+ * trace file is a binary trace dump, for trace.wfs, and the heatmap file a heatmap dump,
+ * for stat.wfs.
+ */
+#define CTL_DIR "/.wfs"
+#define CTL_INUMBER 0xffffff00UL    // inode number of the directory, followed by its files
+
+static const char *ctl_names[] = { "stats", "stats.json", "trace", "heatmap" };
+static void (*const ctl_generators[])(FILE *out) = { stats_report_text, stats_report_json, trace_report, heat_report };
+#define CTL_FILES (sizeof(ctl_names) / sizeof(ctl_names[0]))
+
+/**
+ * Contents of an open control file.
+ */
+struct ctl_file {
+    char *data;
+    size_t len;
+};
+
+/**
+ * Looks up a path in the control directory.
+ *
+ * Returns:
+ *  int: index of the control file, CTL_FILES for the directory itself, or -1 if the path
+ *       is not in the control directory.
+*/
+static int ctl_lookup(const char *path) {
+    size_t len = strlen(CTL_DIR);
+    if (path == NULL || strncmp(path, CTL_DIR, len)) return -1;
+    if (path[len] == '\0') return CTL_FILES;
+    if (path[len] != '/') return -1;
+    for (size_t i = 0; i < CTL_FILES; i++) {
+        if (!strcmp(path + len + 1, ctl_names[i])) return i;
+    }
+    return -1;
+}
+
+static void ctl_stat(int ctl, struct stat *stbuf) {
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
+    if (ctl == CTL_FILES) {
+        stbuf->st_ino = CTL_INUMBER;
+        stbuf->st_mode = S_IFDIR | 0555;
+        stbuf->st_nlink = 2;
+    } else {
+        stbuf->st_ino = CTL_INUMBER + 1 + ctl;
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = 0; // unknown until generated; reads are direct
+    }
+}
+
+static int ctl_readdir(void *buf, fuse_fill_dir_t filler, off_t offset) {
+    for (size_t i = offset; i < CTL_FILES; i++) {
+        struct stat stbuf;
+        memset(&stbuf, 0, sizeof(stbuf));
+        ctl_stat(i, &stbuf);
+        if (filler(buf, ctl_names[i], &stbuf, i + 1))
+            break;
+    }
+    return 0;
+}
+
+/**
+ * Opens a control file, generating its contents. The open file is a snapshot, so reads at
+ * different offsets are consistent with each other.
+*/
+static int ctl_open(int ctl, struct fuse_file_info *fi) {
+    if (ctl == CTL_FILES) return -EISDIR;
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EACCES;
+
+    struct ctl_file *file = malloc(sizeof(*file));
+    if (file == NULL) return -ENOMEM;
+    FILE *out = open_memstream(&file->data, &file->len);
+    if (out == NULL) {
+        free(file);
+        return -ENOMEM;
+    }
+    ctl_generators[ctl](out);
+    fclose(out);
+
+    fi->fh = (uintptr_t)file;
+    fi->direct_io = 1; // the size reported by getattr is not that of the contents
+    return 0;
+}
+
+static int ctl_read(struct fuse_file_info *fi, char *buf, size_t size, off_t offset) {
+    struct ctl_file *file = (struct ctl_file *)(uintptr_t)fi->fh;
+    if (offset >= file->len) return 0;
+    if (size > file->len - offset)
+        size = file->len - offset;
+    memcpy(buf, file->data + offset, size);
+    return size;
+}
+
+static void ctl_release(struct fuse_file_info *fi) {
+    struct ctl_file *file = (struct ctl_file *)(uintptr_t)fi->fh;
+    free(file->data);
+    free(file);
+}
+
+static int wfs_getattr(const char *path, struct stat *stbuf) {
+    int ctl = ctl_lookup(path);
+    if (ctl >= 0) {
+        ctl_stat(ctl, stbuf);
+        return 0;
+    }
+
+    struct wfs_inode *inode = read_path(path);
+    if (inode == NULL) return -ENOENT; // Error: Inode not found
+
+    // Fill in the struct stat with information from the inode
+    fill_stat(inode, stbuf);
+
+    return 0;
+}
+
+/**
+ * Reports space from the accounting counters, without scanning the log. Free blocks are
+ * those past the head of the log plus the dead bytes fsck.wfs would reclaim, while
+ * available blocks are only those that can be appended to right away.
+*/
+static int wfs_statfs(const char *path, struct statvfs *stbuf) {
+    if (imap_sync() != 0) return -ENOMEM;
+
+    uint32_t head = ((struct wfs_sb *)mapped_disk)->head;
+    size_t free_bytes = (head < WFS_CKPT_OFFSET) ? WFS_CKPT_OFFSET - head : 0;
+
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->f_bsize = STATFS_BLOCK_SIZE;
+    stbuf->f_frsize = STATFS_BLOCK_SIZE;
+    stbuf->f_blocks = (WFS_CKPT_OFFSET - sizeof(struct wfs_sb)) / STATFS_BLOCK_SIZE;
+    stbuf->f_bfree = (free_bytes + dead_bytes) / STATFS_BLOCK_SIZE;
+    stbuf->f_bavail = free_bytes / STATFS_BLOCK_SIZE;
+    // Each new inode takes up at least an entry of its own in the log
+    stbuf->f_ffree = free_bytes / sizeof(struct wfs_inode);
+    stbuf->f_favail = stbuf->f_ffree;
+    stbuf->f_files = live_inodes + stbuf->f_ffree;
+    stbuf->f_namemax = MAX_FILE_NAME_LEN - 1;
+    return 0;
+}
+
+/**
+ * Finds the entry with the given name in a directory.
+ *
+ * Parameters:
+ *  dir (wfs_inode*): the latest entry of the directory.
+ *  name (const char*): the name to look for.
+ *
+ * Returns:
+ *  wfs_dentry*: the directory entry, or NULL if there is none.
+*/
+static struct wfs_dentry *find_dentry(struct wfs_inode *dir, const char *name) {
+    struct wfs_dentry *dentries = (struct wfs_dentry *)inode_data(dir);
+    for (size_t i = 0; i < dir->size / sizeof(struct wfs_dentry); i++) {
+        if (!strcmp(dentries[i].name, name)) {
+            stats_add(CTR_DIR_SCANNED, (i + 1) * sizeof(struct wfs_dentry));
+            op_note_scanned((i + 1) * sizeof(struct wfs_dentry));
+            return &dentries[i];
+        }
+    }
+    stats_add(CTR_DIR_SCANNED, dir->size);
+    op_note_scanned(dir->size);
+    return NULL;
+}
+
+/**
+ * Reserves a new version of a directory in the log, with some entries dropped and others
+ * added. Added entries are inserted in inode number order.
+ *
+ * Parameters:
+ *  dir (wfs_inode*): the latest entry of the directory.
+ *  remove (const char**): names of the entries to drop.
+ *  nremove (int): number of names in remove.
+ *  add (wfs_dentry*): the entries to add.
+ *  nadd (int): number of entries in add.
+ *
+ * Returns:
+ *  wfs_log_entry*: the reserved entry, or NULL if the disk is full.
+*/
+static struct wfs_log_entry *reserve_dir(struct wfs_inode *dir, const char **remove, int nremove,
+                                         const struct wfs_dentry *add, int nadd) {
+    uint64_t start = phase_begin();
+    struct wfs_dentry *dentries = (struct wfs_dentry *)inode_data(dir);
+    size_t count = dir->size / sizeof(struct wfs_dentry);
+
+    size_t new_count = count + nadd;
+    for (int i = 0; i < nremove; i++) {
+        if (find_dentry(dir, remove[i]) != NULL) new_count--;
+    }
+
+    struct wfs_log_entry *new_log = (struct wfs_log_entry *)log_reserve(sizeof(struct wfs_inode) + new_count * sizeof(struct wfs_dentry));
+    if (new_log == NULL) return NULL;
+    new_log->inode = *dir;
+    new_log->inode.flags = WFS_ENTRY_INODE;
+    new_log->inode.size = new_count * sizeof(struct wfs_dentry);
+    new_log->inode.atime = time(NULL);
+    new_log->inode.mtime = time(NULL);
+    new_log->inode.ctime = time(NULL);
+
+    // Copy the entries that stay
+    struct wfs_dentry *new_dentries = (struct wfs_dentry *)new_log->data;
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        int removed = 0;
+        for (int j = 0; j < nremove; j++) {
+            if (!strcmp(dentries[i].name, remove[j])) removed = 1;
+        }
+        if (!removed) new_dentries[n++] = dentries[i];
+    }
+
+    // Insert the new entries, keeping the entries in order
+    for (int i = 0; i < nadd; i++) {
+        size_t pos = n;
+        while (pos > 0 && new_dentries[pos - 1].inode_number > add[i].inode_number) pos--;
+        memmove(&new_dentries[pos + 1], &new_dentries[pos], (n - pos) * sizeof(struct wfs_dentry));
+        new_dentries[pos] = add[i];
+        n++;
+    }
+
+    phase_end(PHASE_BUILD, start);
+    return new_log;
+}
+
+/**
+ * Creates a file or directory. The inode of the new node and a new version of its parent
+ * directory holding an entry for it are appended to the log and committed together, and
+ * the parent is located with a single path walk.
+ *
+ * Parameters:
+ *  path (const char*): absolute path of the new node.
+ *  mode (mode_t): type and permissions of the new node.
+ *  inode_number (ulong*): set to the inode number of the new node on success.
+ *
+ * Returns:
+ *  int: 0 on success, or a negative errno on failure.
+*/
+static int create_node(const char *path, mode_t mode, ulong *inode_number) {
+    char name[strlen(path) + 1];
+    char parent_path[strlen(path) + 2];
+    memset(name, 0, sizeof(name));
+    memset(parent_path, 0, sizeof(parent_path));
+    parsepath(name, parent_path, path);
+    if (name[0] == '\0') return -EEXIST; // the root directory
+    if (ctl_lookup(path) >= 0) return -EEXIST;
+    if (strlen(name) >= MAX_FILE_NAME_LEN) return -ENAMETOOLONG;
+
+    // Get existing parent inode
+    struct wfs_log_entry *parent_log = (struct wfs_log_entry *)read_path(parent_path);
+    if (parent_log == NULL) return -ENOENT;
+    if (!S_ISDIR(parent_log->inode.mode)) return -ENOTDIR;
+
+    // If pathname already exists, fail with EEXIST
+    ulong existing;
+    if (dcache_lookup(parent_log->inode.inode_number, name, &existing)) return -EEXIST;
+    if (find_dentry(&parent_log->inode, name) != NULL) return -EEXIST;
+    struct wfs_dentry *dentries = (struct wfs_dentry *)inode_data(&parent_log->inode);
+
+    // Create a new log entry for the node
+    uint64_t start = phase_begin();
+    struct wfs_log_entry *new_log = (struct wfs_log_entry *)log_reserve(sizeof(struct wfs_inode));
+    if (new_log == NULL) return -ENOSPC;
+
+    // Set the mode and other attributes based on the provided arguments
+    struct wfs_inode inode;
+    inode.inode_number = get_largest_inumber() + 1;
+    inode.deleted = 0;
+    inode.mode = mode;
+    inode.uid = getuid();
+    inode.gid = getgid();
+    inode.flags = WFS_ENTRY_INODE;
+    inode.size = 0;
+    inode.atime = time(NULL);
+    inode.mtime = time(NULL);
+    inode.ctime = time(NULL);
+    inode.links = 1;
+    new_log->inode = inode;
+
+    // Create new log entry for parent, with the directory entry of the new node appended.
+    // The new node has the largest inode number, so the entries stay in order.
+    struct wfs_log_entry *new_parent_log = (struct wfs_log_entry *)log_reserve(sizeof(struct wfs_inode) + parent_log->inode.size + sizeof(struct wfs_dentry));
+    if (new_parent_log == NULL) {
+        log_abort();
+        return -ENOSPC;
+    }
+    new_parent_log->inode = parent_log->inode;
+    new_parent_log->inode.deleted = 0;
+    new_parent_log->inode.flags = WFS_ENTRY_INODE;
+    new_parent_log->inode.size = parent_log->inode.size + sizeof(struct wfs_dentry);
+    new_parent_log->inode.atime = time(NULL);
+    new_parent_log->inode.mtime = time(NULL);
+    new_parent_log->inode.ctime = time(NULL);
+    memcpy(new_parent_log->data, dentries, parent_log->inode.size);
+
+    struct wfs_dentry *new_dentry = (struct wfs_dentry *)(new_parent_log->data + parent_log->inode.size);
+    memset(new_dentry, 0, sizeof(struct wfs_dentry));
+    strcpy(new_dentry->name, name);
+    new_dentry->inode_number = inode.inode_number;
+    phase_end(PHASE_BUILD, start);
+
+    // Update the log
+    log_commit();
+    dcache_insert(new_parent_log->inode.inode_number, name, inode.inode_number);
+
+    op_note_inode(inode.inode_number);
+    *inode_number = inode.inode_number;
+    return 0;
+}
+
+static int wfs_mknod(const char *path, mode_t mode, dev_t dev) {
+    ulong inode_number;
+    return create_node(path, mode, &inode_number);
+}
+
+static int wfs_mkdir(const char *path, mode_t mode) {
+    ulong inode_number;
+    return create_node(path, S_IFDIR | mode, &inode_number);
+}
+
+static int wfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    ulong inode_number;
+    int ret = create_node(path, mode, &inode_number);
+    if (ret != 0) return ret;
+
+    // Open the new file
+    struct wfs_imap_slot *slot = &imap[inode_number];
+    slot->open_entry = slot->entry;
+    fi->fh = inode_number + 1;
+    return 0;
+}
+
+/**
+ * Writes into the space reserved for a file past its data in use, then appends a fill
+ * entry that makes the written bytes part of the file.
+ *
+ * Parameters:
+ *  inode (wfs_inode*): the latest entry of the file.
+ *  buf (fuse_bufvec*): the data to write.
+ *  offset (off_t): the offset in the file to write at, at or past the data in use.
+ *
+ * Returns:
+ *  int: the number of bytes written, or a negative errno on failure.
+*/
+static int fill_file(struct wfs_inode *inode, struct fuse_bufvec *buf, off_t offset) {
+    size_t size = fuse_buf_size(buf);
+    size_t used = inode_data_size(inode);
+    char *data = inode_data(inode);
+
+    // Zero the reserved bytes skipped over, then copy the new data in place
+    uint64_t start = phase_begin();
+    memset(data + used, 0, offset - used);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    dst.buf[0].mem = data + offset;
+    ssize_t copied = fuse_buf_copy(&dst, buf, 0);
+    phase_end(PHASE_BUILD, start);
+    if (copied < 0 || (size_t)copied != size) return (copied < 0) ? copied : -EIO;
+
+    struct wfs_inode attr = *inode;
+    if (offset + size > attr.size) attr.size = offset + size;
+    attr.atime = time(NULL);
+    attr.mtime = time(NULL);
+    attr.ctime = time(NULL);
+    int ret = write_fill(&attr, offset + size, 1);
+    if (ret < 0) return ret;
+
+    // The zeroed and copied bytes went to disk too, not only the fill entry
+    log_written_in_place(inode->inode_number, data + used, offset + size - used);
+    return size;
+}
+
+/**
+ * Appends a new version of a file with the contents of a FUSE buffer written at the given
+ * offset. The new entry is assembled in place at the head of the log: the unchanged parts
+ * of the file are copied straight from the previous entry, and the incoming data straight
+ * from the FUSE buffer, so every byte is copied once.
+ *
+ * Parameters:
+ *  inode (wfs_inode*): the latest entry of the file.
+ *  buf (fuse_bufvec*): the data to write.
+ *  offset (off_t): the offset in the file to write at.
+ *
+ * Returns:
+ *  int: the number of bytes written, or a negative errno on failure.
+*/
+static int write_file(struct wfs_inode *inode, struct fuse_bufvec *buf, off_t offset) {
+    size_t size = fuse_buf_size(buf);
+    size_t old_size = inode->size;
+    size_t new_size = (offset + size > old_size) ? offset + size : old_size;
+    char *old_data = inode_data(inode);
+    size_t old_stored = inode_data_size(inode);
+
+    // Writes past the data in use that fit in space reserved by fallocate fill it in place;
+    // those bytes are not part of any version of the file yet. Slack left by a truncation
+    // or a punched hole is not reserved: it still holds the data of older versions.
+    struct wfs_data_use *use = &imap[inode->inode_number].use;
+    if (size > 0 && use->reserved && offset >= old_stored && offset + size <= use->capacity)
+        return fill_file(inode, buf, offset);
+
+    // Reserve the new log entry
+    uint64_t start = phase_begin();
+    struct wfs_log_entry *new_log = (struct wfs_log_entry *)log_reserve(sizeof(struct wfs_inode) + new_size);
+    if (new_log == NULL) return -ENOSPC;
+
+    // Update inode
+    new_log->inode = *inode;
+    new_log->inode.flags = WFS_ENTRY_INODE;
+    new_log->inode.size = new_size;
+    new_log->inode.atime = time(NULL);
+    new_log->inode.mtime = time(NULL);
+    new_log->inode.ctime = time(NULL);
+
+    // Copy the existing data around the written range, zero filling holes and any gap past
+    // the old end
+    size_t head_len = ((size_t)offset < old_stored) ? offset : old_stored;
+    memcpy(new_log->data, old_data, head_len);
+    memset(new_log->data + head_len, 0, offset - head_len);
+    size_t tail_start = offset + size;
+    if (tail_start < old_stored)
+        memcpy(new_log->data + tail_start, old_data + tail_start, old_stored - tail_start);
+    size_t zero_start = (tail_start > old_stored) ? tail_start : old_stored;
+    if (zero_start < new_size)
+        memset(new_log->data + zero_start, 0, new_size - zero_start);
+
+    // Copy the new data to the appropriate offset
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    dst.buf[0].mem = new_log->data + offset;
+    ssize_t copied = fuse_buf_copy(&dst, buf, 0);
+    if (copied < 0 || (size_t)copied != size) {
+        log_abort();
+        return (copied < 0) ? copied : -EIO;
+    }
+    phase_end(PHASE_BUILD, start);
+
+    log_commit();
+    return size;
+}
+
+/**
+ * Appends the buffered writes of a file to the log as a new version of the file.
+ *
+ * Parameters:
+ *  inode (wfs_inode**): the latest entry of the file, updated to the new entry.
+ *
+ * Returns:
+ *  int: 0 on success, or a negative errno on failure, in which case the buffer is kept.
+*/
+static int flush_wbuf(struct wfs_inode **inode) {
+    ulong inode_number = (*inode)->inode_number;
+    if (inode_number >= imap_len || imap[inode_number].wbuf == NULL) return 0;
+
+    uint64_t start = phase_begin();
+    struct wfs_wbuf *wbuf = imap[inode_number].wbuf;
+    struct fuse_bufvec src = FUSE_BUFVEC_INIT(wbuf->len);
+    src.buf[0].mem = wbuf->data;
+    int ret = write_file(*inode, &src, wbuf->offset);
+    phase_end(PHASE_FLUSH, start);
+    if (ret < 0) return ret;
+
+    imap[inode_number].wbuf = NULL;
+    free(wbuf);
+    *inode = read_inumber(inode_number);
+    return 0;
+}
+
+/**
+ * Writes to a file through its write-back buffer. A write that extends or overlaps the
+ * buffered range is merged into it; any other write, or one that would overflow the
+ * buffer, flushes the buffer first. Writes larger than the buffer go straight to the log.
+ *
+ * Parameters:
+ *  inode (wfs_inode*): the latest entry of the file.
+ *  buf (fuse_bufvec*): the data to write.
+ *  offset (off_t): the offset in the file to write at.
+ *
+ * Returns:
+ *  int: the number of bytes written, or a negative errno on failure.
+*/
+static int buffer_write(struct wfs_inode *inode, struct fuse_bufvec *buf, off_t offset) {
+    ulong inode_number = inode->inode_number;
+    size_t size = fuse_buf_size(buf);
+    struct wfs_wbuf *wbuf = imap[inode_number].wbuf;
+
+    if (wbuf != NULL && (offset < wbuf->offset || offset > wbuf->offset + wbuf->len
+                         || offset + size - wbuf->offset > WBUF_SIZE)) {
+        int ret = flush_wbuf(&inode);
+        if (ret < 0) return ret;
+        wbuf = NULL;
+    }
+    if (size >= WBUF_SIZE) return write_file(inode, buf, offset);
+
+    if (wbuf == NULL) {
+        wbuf = malloc(sizeof(struct wfs_wbuf));
+        if (wbuf == NULL) return write_file(inode, buf, offset);
+        wbuf->offset = offset;
+        wbuf->len = 0;
+        imap[inode_number].wbuf = wbuf;
+    }
+
+    // Copy the new data into the buffer
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    dst.buf[0].mem = wbuf->data + (offset - wbuf->offset);
+    ssize_t copied = fuse_buf_copy(&dst, buf, 0);
+    if (copied < 0 || (size_t)copied != size) return (copied < 0) ? copied : -EIO;
+
+    if (offset + size > wbuf->offset + wbuf->len)
+        wbuf->len = offset + size - wbuf->offset;
+    wbuf->mtime = time(NULL);
+    return size;
+}
+
+static int wfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    op_note_range(offset, size);
+    if (ctl_lookup(path) >= 0) return ctl_read(fi, buf, size, offset);
+
+    struct wfs_inode *inode;
+    int ret = get_inode(path, fi, &inode);
+    if (ret != 0) return ret;
+    if (!S_ISREG(inode->mode)) return -EISDIR;
+    ret = flush_wbuf(&inode);
+    if (ret < 0) return ret;
+
+    // Calculate the maximum number of bytes that can be read
+    if (offset >= inode->size) return 0;
+    size_t max_size = inode->size - offset;
+    size = (size < max_size) ? size : max_size;
+
+    // Copy data from the log entry to the buffer, and zeros for the part in a hole
+    size_t stored = inode_data_size(inode);
+    size_t stored_len = (offset >= stored) ? 0 : (stored - offset < size) ? stored - offset : size;
+    memcpy(buf, inode_data(inode) + offset, stored_len);
+    memset(buf + stored_len, 0, size - stored_len);
+    account_read(inode->inode_number, size, stored_len);
+    heat_record(inode_data(inode) + offset, stored_len, 0);
+
+    // Update inode metadata since file has been accessed
+    touch_atime(inode);
+
+    return size; // Return the actual number of bytes read
+}
+
+static int wfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+    op_note_range(offset, size);
+    if (ctl_lookup(path) >= 0) {
+        struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec));
+        if (bufv == NULL) return -ENOMEM;
+        *bufv = FUSE_BUFVEC_INIT(size);
+        bufv->buf[0].mem = malloc(size);
+        if (bufv->buf[0].mem == NULL) {
+            free(bufv);
+            return -ENOMEM;
+        }
+        bufv->buf[0].size = ctl_read(fi, bufv->buf[0].mem, size, offset);
+        *bufp = bufv;
+        return 0;
+    }
+
+    struct wfs_inode *inode;
+    int ret = get_inode(path, fi, &inode);
+    if (ret != 0) return ret;
+    if (!S_ISREG(inode->mode)) return -EISDIR;
+    ret = flush_wbuf(&inode);
+    if (ret < 0) return ret;
+
+    // Calculate the maximum number of bytes that can be read
+    if (offset >= inode->size)
+        size = 0;
+    else if (size > inode->size - offset)
+        size = inode->size - offset;
+
+    size_t stored = inode_data_size(inode);
+    size_t stored_len = (offset >= stored) ? 0 : (stored - offset < size) ? stored - offset : size;
+
+    // Describe the data as a range of the disk file rather than copying it, so FUSE can
+    // splice it straight from the page cache into /dev/fuse. FUSE frees the memory of the
+    // returned buffers, so it cannot point into the mapping itself. The part of the read
+    // that falls in a hole is served from a zeroed buffer.
+    struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec) + sizeof(struct fuse_buf));
+    if (bufv == NULL) return -ENOMEM;
+    *bufv = FUSE_BUFVEC_INIT(stored_len);
+    bufv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    bufv->buf[0].fd = disk_fd;
+    bufv->buf[0].pos = inode_data(inode) + offset - mapped_disk;
+    if (stored_len < size) {
+        bufv->buf[1] = bufv->buf[0];
+        bufv->buf[1].size = size - stored_len;
+        bufv->buf[1].flags = 0;
+        bufv->buf[1].fd = -1;
+        bufv->buf[1].mem = calloc(1, size - stored_len);
+        if (bufv->buf[1].mem == NULL) {
+            free(bufv);
+            return -ENOMEM;
+        }
+        bufv->count = 2;
+    }
+    *bufp = bufv;
+    account_read(inode->inode_number, size, stored_len);
+    heat_record(inode_data(inode) + offset, stored_len, 0);
+
+    // Update inode metadata since file has been accessed
+    touch_atime(inode);
+
+    return 0;
+}
+
+static int wfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    op_note_range(offset, size);
+    struct wfs_inode *inode;
+    int ret = get_inode(path, fi, &inode);
+    if (ret != 0) return ret;
+    if (!S_ISREG(inode->mode)) return -EISDIR;
+
+    struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+    src.buf[0].mem = (void *)buf;
+    ret = writeback_cache ? buffer_write(inode, &src, offset) : write_file(inode, &src, offset);
+    if (ret > 0) account_write(inode->inode_number, ret);
+    return ret;
+}
+
+static int wfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+    op_note_range(offset, fuse_buf_size(buf));
+    struct wfs_inode *inode;
+    int ret = get_inode(path, fi, &inode);
+    if (ret != 0) return ret;
+    if (!S_ISREG(inode->mode)) return -EISDIR;
+
+    ret = writeback_cache ? buffer_write(inode, buf, offset) : write_file(inode, buf, offset);
+    if (ret > 0) account_write(inode->inode_number, ret);
+    return ret;
+}
+
+static int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+    op_note_range(offset, 0);
+    int ctl = ctl_lookup(path);
+    if (ctl == CTL_FILES) return ctl_readdir(buf, filler, offset);
+    if (ctl >= 0) return -ENOTDIR;
+
+    struct wfs_inode *inode;
+    int ret = get_inode(path, fi, &inode);
+    if (ret != 0) return ret;
+    if (!S_ISDIR(inode->mode)) return -EISNAM; // Error: Not a directory
+    
+    // Look through the directory entries to find the filenames
+    struct wfs_dentry *dir_entry = (struct wfs_dentry *)inode_data(inode);
+    struct wfs_dentry *dir_end = dir_entry + inode->size / sizeof(struct wfs_dentry);
+    touch_atime(inode);
+
+    // Resume after the entry whose cookie was handed out last. Entries are ordered by
+    // inode number, so the first entry to return is found with a binary search, and the
+    // cookie stays valid when entries are inserted or removed in between calls.
+    if (offset > 0) {
+        struct wfs_dentry *low = dir_entry, *high = dir_end;
+        while (low < high) {
+            struct wfs_dentry *mid = low + (high - low) / 2;
+            if (dentry_cookie(mid) <= offset)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        dir_entry = low;
+    }
+
+    struct wfs_dentry *first = dir_entry;
+    for (; dir_entry < dir_end; dir_entry++) {
+        // Hand FUSE the attributes of the child along with its name, and remember the
+        // name so the lookups that typically follow (ls -l, find) skip the path walk
+        struct wfs_inode *child = read_inumber(dir_entry->inode_number);
+        struct stat child_stat;
+        memset(&child_stat, 0, sizeof(child_stat));
+        if (child != NULL) {
+            fill_stat(child, &child_stat);
+            dcache_insert(inode->inode_number, dir_entry->name, dir_entry->inode_number);
+        }
+
+        // Use the filler function to provide directory entries to FUSE, stopping once
+        // its reply buffer is full; the kernel comes back with the last cookie it saw
+        if (filler(buf, dir_entry->name, child != NULL ? &child_stat : NULL, dentry_cookie(dir_entry)))
+            break;
+    }
+    heat_record((char *)first, (char *)(dir_entry < dir_end ? dir_entry + 1 : dir_end) - (char *)first, 0);
+    return 0;
+}
+
+/**
+ * Reserves a tombstone for a node, which deletes it once committed.
+ *
+ * Parameters:
+ *  node (wfs_inode*): the latest entry of the node.
+ *
  * Returns:
- *  ulong: the largest inode number in the disk.
+ *  wfs_log_entry*: the reserved entry, or NULL if the disk is full.
 */
-static ulong get_largest_inumber() {
-    ulong max_inode_number = 0;
-    char *current_position = mapped_disk + sizeof(struct wfs_sb);
-
-    while(current_position < mapped_disk + ((struct wfs_sb *)mapped_disk)->head) {
-        struct wfs_log_entry *current_entry = (struct wfs_log_entry *)current_position;
-        if (current_entry->inode.inode_number > max_inode_number)
-            max_inode_number = current_entry->inode.inode_number;
-        current_position += (sizeof(struct wfs_inode) + current_entry->inode.size);
-    }
-
-    return max_inode_number;
+static struct wfs_log_entry *reserve_tombstone(struct wfs_inode *node) {
+    struct wfs_log_entry *tombstone = (struct wfs_log_entry *)log_reserve(sizeof(struct wfs_inode));
+    if (tombstone == NULL) return NULL;
+    tombstone->inode = *node;
+    tombstone->inode.deleted = 1;
+    tombstone->inode.flags = WFS_ENTRY_TOMBSTONE;
+    tombstone->inode.size = 0;
+    tombstone->inode.ctime = time(NULL);
+    tombstone->inode.links = 0;
+    return tombstone;
 }
 
 /**
- * Get the live inode associated with the given inode number.
- * 
+ * Removes a file or an empty directory. A new version of the parent directory without the
+ * entry of the node and a tombstone for the node are committed together; the entries of
+ * the node are never written to.
+ *
  * Parameters:
- *  inode_number (uint): inode number of the inode.
- * 
+ *  path (const char*): absolute path of the node.
+ *  dir (int): 1 to remove a directory, 0 to remove a file.
+ *
  * Returns:
- *  wfs_inode*: pointer to inode structure associated with inode number.
+ *  int: 0 on success, or a negative errno on failure.
 */
-static struct wfs_inode *read_inumber(uint inode_number) {
-    char *current_position = mapped_disk + sizeof(struct wfs_sb);
-    struct wfs_inode *latest_matching_entry = NULL;
-    
-    while (current_position < mapped_disk + ((struct wfs_sb *)mapped_disk)->head) {
-        struct wfs_log_entry *current_entry = (struct wfs_log_entry *)current_position;
-        if (current_entry->inode.inode_number == inode_number)
-            latest_matching_entry = &(current_entry->inode);
-        current_position += current_entry->inode.size + sizeof(struct wfs_inode);
+static int remove_node(const char *path, int dir) {
+    char name[strlen(path) + 1];
+    char parent_path[strlen(path) + 2];
+    memset(name, 0, sizeof(name));
+    memset(parent_path, 0, sizeof(parent_path));
+    parsepath(name, parent_path, path);
+    if (name[0] == '\0') return -EBUSY; // the root directory
+
+    struct wfs_inode *parent = read_path(parent_path);
+    if (parent == NULL) return -ENOENT;
+    if (!S_ISDIR(parent->mode)) return -ENOTDIR;
+    struct wfs_dentry *dentry = find_dentry(parent, name);
+    if (dentry == NULL) return -ENOENT;
+    op_note_inode(dentry->inode_number);
+    struct wfs_inode *node = read_inumber(dentry->inode_number);
+    if (node == NULL) return -ENOENT;
+    if (dir && !S_ISDIR(node->mode)) return -ENOTDIR;
+    if (!dir && S_ISDIR(node->mode)) return -EISDIR;
+    if (dir && node->size != 0) return -ENOTEMPTY;
+
+    const char *remove[] = { name };
+    if (reserve_dir(parent, remove, 1, NULL, 0) == NULL) return -ENOSPC;
+    if (reserve_tombstone(node) == NULL) {
+        log_abort();
+        return -ENOSPC;
     }
 
-    return latest_matching_entry;
+    // Buffered writes of a deleted file are never written out
+    free(imap[node->inode_number].wbuf);
+    imap[node->inode_number].wbuf = NULL;
+
+    // Update the log
+    log_commit();
+    return 0;
+}
+
+static int wfs_unlink(const char *path) {
+    return remove_node(path, 0);
+}
+
+static int wfs_rmdir(const char *path) {
+    return remove_node(path, 1);
 }
 
 /**
- * Get the live inode associated with a given path. Iterates over disk space.
- * 
- * Parameters:
- *  path (const char*): the path, represented as a string.
- * 
- * Returns:
- *  wfs_inode*: pointer to inode structure associated with path.
+ * Renames a file or directory, replacing any node at the new path. The new versions of the
+ * parent directories are committed together, so the rename is atomic and its cost does not
+ * depend on the size of the file. FUSE 2 does not pass renameat2() flags down, so there is
+ * no RENAME_NOREPLACE or RENAME_EXCHANGE.
 */
-static struct wfs_inode *read_path(const char *path) {
-    // Start with the root inode number
-    ulong current_inode_number = 0;
+static int wfs_rename(const char *from, const char *to) {
+    char from_name[strlen(from) + 1], from_parent_path[strlen(from) + 2];
+    char to_name[strlen(to) + 1], to_parent_path[strlen(to) + 2];
+    memset(from_name, 0, sizeof(from_name));
+    memset(from_parent_path, 0, sizeof(from_parent_path));
+    memset(to_name, 0, sizeof(to_name));
+    memset(to_parent_path, 0, sizeof(to_parent_path));
+    parsepath(from_name, from_parent_path, from);
+    parsepath(to_name, to_parent_path, to);
+    if (from_name[0] == '\0' || to_name[0] == '\0') return -EBUSY; // the root directory
+    if (ctl_lookup(from) >= 0 || ctl_lookup(to) >= 0) return -EPERM;
+    if (strlen(to_name) >= MAX_FILE_NAME_LEN) return -ENAMETOOLONG;
+
+    // Get the parents and the node
+    struct wfs_inode *from_parent = read_path(from_parent_path);
+    struct wfs_inode *to_parent = read_path(to_parent_path);
+    if (from_parent == NULL || to_parent == NULL) return -ENOENT;
+    if (!S_ISDIR(from_parent->mode) || !S_ISDIR(to_parent->mode)) return -ENOTDIR;
+    struct wfs_dentry *from_dentry = find_dentry(from_parent, from_name);
+    if (from_dentry == NULL) return -ENOENT;
+    op_note_inode(from_dentry->inode_number);
+    struct wfs_inode *node = read_inumber(from_dentry->inode_number);
+    if (node == NULL) return -EIO;
+
+    // A directory cannot be moved into itself
+    size_t from_len = strlen(from);
+    if (S_ISDIR(node->mode) && !strncmp(to, from, from_len) && to[from_len] == '/') return -EINVAL;
+
+    struct wfs_dentry *to_dentry = find_dentry(to_parent, to_name);
+    struct wfs_inode *target = (to_dentry != NULL) ? read_inumber(to_dentry->inode_number) : NULL;
+    if (target != NULL && target->inode_number == node->inode_number) return 0;
+    if (target != NULL) {
+        if (S_ISDIR(node->mode) && !S_ISDIR(target->mode)) return -ENOTDIR;
+        if (!S_ISDIR(node->mode) && S_ISDIR(target->mode)) return -EISDIR;
+        if (S_ISDIR(target->mode) && target->size != 0) return -ENOTEMPTY;
+    }
 
-    // Make a copy of the path since strtok modifies the string
-    char path_copy[strlen(path) + 1];
-    strcpy(path_copy, path);
+    // The directory entry of the node under its new name
+    struct wfs_dentry moved;
+    memset(&moved, 0, sizeof(moved));
+    strcpy(moved.name, to_name);
+    moved.inode_number = node->inode_number;
 
-    // Tokenize the path using '/'
-    char *token = strtok(path_copy, "/");
-    int found = 1; // This will be reset to 0 unless it is the root directory.
-    while (token != NULL) {
-        found = 0;
-        struct wfs_log_entry *latest_matching_entry = (struct wfs_log_entry *)read_inumber(current_inode_number);
-        if(!S_ISDIR(latest_matching_entry->inode.mode)) return NULL;
-        // Found the inode, return a pointer to it
-        struct wfs_dentry *dir_entry = (struct wfs_dentry *)latest_matching_entry->data;
-        int directory_offset = 0;
-        while (directory_offset < latest_matching_entry->inode.size) {
-            if (!strcmp(dir_entry->name, token)) {
-                found = 1;
-                current_inode_number = dir_entry->inode_number;
-                break;
-            }
-            // Move to the next directory entry
-            directory_offset += sizeof(struct wfs_dentry); // Corrected line
-            dir_entry++; // Corrected line
+    const char *from_remove[] = { from_name, to_name };
+    const char *to_remove[] = { to_name };
+    if (from_parent->inode_number == to_parent->inode_number) {
+        if (reserve_dir(from_parent, from_remove, 2, &moved, 1) == NULL) return -ENOSPC;
+    } else {
+        if (reserve_dir(from_parent, from_remove, 1, NULL, 0) == NULL) return -ENOSPC;
+        if (reserve_dir(to_parent, to_remove, 1, &moved, 1) == NULL) {
+            log_abort();
+            return -ENOSPC;
         }
-        // Get the next token
-        token = strtok(NULL, "/");
     }
-    if(!found)
-        return NULL;
 
-    return read_inumber(current_inode_number);
+    // A replaced node is deleted along with the rename
+    if (target != NULL) {
+        if (reserve_tombstone(target) == NULL) {
+            log_abort();
+            return -ENOSPC;
+        }
+        free(imap[target->inode_number].wbuf);
+        imap[target->inode_number].wbuf = NULL;
+    }
+
+    // Update the log
+    log_commit();
+    return 0;
 }
 
-static int wfs_getattr(const char *path, struct stat *stbuf) {
+static int wfs_chmod(const char *path, mode_t mode) {
     struct wfs_inode *inode = read_path(path);
-    if (inode == NULL) return -ENOENT; // Error: Inode not found
-
-    // Fill in the struct stat with information from the inode
-    stbuf->st_uid = inode->uid;
-    stbuf->st_gid = inode->gid;
-    stbuf->st_atime = inode->atime;
-    stbuf->st_mtime = inode->mtime;
-    stbuf->st_mode = inode->mode;
-    stbuf->st_nlink = inode->links;
-    stbuf->st_size = inode->size;
+    if (inode == NULL) return -ENOENT;
+    // Buffered writes land first, so the entry below carries the attributes they leave
+    int ret = flush_wbuf(&inode);
+    if (ret < 0) return ret;
+
+    struct wfs_inode attr = *inode;
+    attr.mode = (inode->mode & S_IFMT) | (mode & ~S_IFMT);
+    attr.atime = inode_atime(inode);
+    attr.ctime = time(NULL);
+    return write_attr(&attr);
+}
 
-    return 0;
+static int wfs_chown(const char *path, uid_t uid, gid_t gid) {
+    struct wfs_inode *inode = read_path(path);
+    if (inode == NULL) return -ENOENT;
+    // Buffered writes land first, so the entry below carries the attributes they leave
+    int ret = flush_wbuf(&inode);
+    if (ret < 0) return ret;
+
+    // An id of -1 leaves it unchanged
+    struct wfs_inode attr = *inode;
+    if (uid != (uid_t)-1) attr.uid = uid;
+    if (gid != (gid_t)-1) attr.gid = gid;
+    attr.atime = inode_atime(inode);
+    attr.ctime = time(NULL);
+    return write_attr(&attr);
 }
 
-static int wfs_mknod(const char *path, mode_t mode, dev_t dev) {
-    // If pathname already exists, or is a symbolic link, fail with EEXIST
-    if (read_path(path) != NULL) return -EEXIST;
+static int wfs_utimens(const char *path, const struct timespec tv[2]) {
+    struct wfs_inode *inode = read_path(path);
+    if (inode == NULL) return -ENOENT;
+    // Buffered writes land first, or flushing them later would stamp over the times set here
+    int ret = flush_wbuf(&inode);
+    if (ret < 0) return ret;
+
+    uint now = time(NULL);
+    struct wfs_inode attr = *inode;
+    attr.atime = inode_atime(inode);
+    if (tv == NULL || tv[0].tv_nsec == UTIME_NOW)
+        attr.atime = now;
+    else if (tv[0].tv_nsec != UTIME_OMIT)
+        attr.atime = tv[0].tv_sec;
+    if (tv == NULL || tv[1].tv_nsec == UTIME_NOW)
+        attr.mtime = now;
+    else if (tv[1].tv_nsec != UTIME_OMIT)
+        attr.mtime = tv[1].tv_sec;
+    attr.ctime = now;
+    return write_attr(&attr);
+}
 
-    // Create a new log entry for the file
-    struct wfs_log_entry *new_log = malloc(sizeof(struct wfs_inode));
+/**
+ * Changes the size of a file with an attribute entry. Shrinking drops the tail of the file,
+ * and growing it leaves a hole, so neither rewrites the data.
+ *
+ * Parameters:
+ *  inode (wfs_inode*): the latest entry of the file.
+ *  size (off_t): the new size.
+ *
+ * Returns:
+ *  int: 0 on success, or a negative errno on failure.
+*/
+static int truncate_file(struct wfs_inode *inode, off_t size) {
+    if (S_ISDIR(inode->mode)) return -EISDIR;
+    if (size < 0) return -EINVAL;
+    if (size > UINT32_MAX) return -EFBIG;
+
+    // Buffered writes land first, and are cut by the truncation like any other data
+    int ret = flush_wbuf(&inode);
+    if (ret < 0) return ret;
+
+    struct wfs_inode attr = *inode;
+    attr.size = size;
+    attr.atime = inode_atime(inode);
+    attr.mtime = time(NULL);
+    attr.ctime = time(NULL);
+    return write_attr(&attr);
+}
 
-    // Set the mode and other attributes based on the provided arguments
-    struct wfs_inode inode;
-    inode.inode_number = get_largest_inumber() + 1;
-    inode.deleted = 0;
-    inode.mode = mode;
-    inode.uid = getuid();
-    inode.gid = getgid();
-    inode.flags = 0;
-    inode.size = 0;
-    inode.atime = time(NULL);
-    inode.mtime = time(NULL);
-    inode.ctime = time(NULL);
-    inode.links = 1;
-    new_log->inode = inode;
+static int wfs_truncate(const char *path, off_t size) {
+    op_note_range(size, 0);
+    struct wfs_inode *inode = read_path(path);
+    if (inode == NULL) return -ENOENT;
 
-    // Update the log
-    if (mapped_disk + ((struct wfs_sb *)mapped_disk)->head + sizeof(*new_log) > mapped_disk + DISK_SIZE) return -ENOSPC;
-    memcpy(mapped_disk + ((struct wfs_sb *)mapped_disk)->head, new_log, sizeof(*new_log));
-    ((struct wfs_sb *)mapped_disk)->head += sizeof(*new_log);
+    return truncate_file(inode, size);
+}
 
-    free(new_log);
+static int wfs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    op_note_range(size, 0);
+    struct wfs_inode *inode;
+    int ret = get_inode(path, fi, &inode);
+    if (ret != 0) return ret;
 
-    // Update parent
-    char name[MAX_FILE_NAME_LEN] = {0};
-    char parent_path[MAX_PATH_LEN] = {0};
-    parsepath(name, parent_path, path);
+    return truncate_file(inode, size);
+}
 
-    // Create directory entry for new file
-    struct wfs_dentry *new_dentry = malloc(sizeof(struct wfs_dentry));
-    strcpy(new_dentry->name, name);
-    new_dentry->inode_number = inode.inode_number;
+static int wfs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    op_note_range(offset, length);
+    struct wfs_inode *inode;
+    int ret = get_inode(path, fi, &inode);
+    if (ret != 0) return ret;
+    if (!S_ISREG(inode->mode)) return -ENODEV;
+    if (offset < 0 || length <= 0) return -EINVAL;
+    if (offset + length > UINT32_MAX) return -EFBIG;
+    ret = flush_wbuf(&inode);
+    if (ret < 0) return ret;
+
+    size_t used = inode_data_size(inode);
+    size_t end = offset + length;
+
+    if (mode == (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+        if (offset >= used) return 0; // already a hole
+
+        // A hole reaching the end of the data just stops the data short of it
+        struct wfs_inode attr = *inode;
+        attr.atime = inode_atime(inode);
+        attr.mtime = time(NULL);
+        attr.ctime = time(NULL);
+        if (end >= used) return write_fill(&attr, offset, 0);
+
+        // A hole inside the data is zeroed in place in the latest data entry, once the new
+        // times are in the log. Those bytes belong to the current version alone, so no
+        // other version changes, and the punch costs the length of the hole rather than a
+        // copy of the file. There is no entry for a hole inside the data, though: the zeroed
+        // bytes keep their space in the log, and only fsck.wfs compacts them away.
+        ret = write_attr(&attr);
+        if (ret < 0) return ret;
+        char *data = inode_data(inode);
+        memset(data + offset, 0, length);
+        log_written_in_place(inode->inode_number, data + offset, length);
+        return 0;
+    }
+    if (mode != 0 && mode != FALLOC_FL_KEEP_SIZE) return -EOPNOTSUPP;
+
+    // Reserve the space by appending a copy of the data in use with room up to the end of
+    // the range, unless the range is already in use or reserved
+    struct wfs_inode attr = *inode;
+    attr.atime = inode_atime(inode);
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > attr.size) {
+        attr.size = end;
+        attr.ctime = time(NULL);
+    }
+    struct wfs_data_use *use = &imap[inode->inode_number].use;
+    if (end <= used || (use->reserved && end <= use->capacity)) {
+        if (attr.size == inode->size) return 0;
+        return write_attr(&attr);
+    }
 
-    // Get existing parent inode
-    struct wfs_inode *parent_inode = read_path(parent_path);
-    if (parent_inode == NULL) return -ENOENT;
-
-    struct wfs_log_entry *parent_log = (struct wfs_log_entry *)parent_inode;
-
-    // Create new inode entry for parent
-    struct wfs_inode new_parent_inode;
-    new_parent_inode.inode_number = parent_log->inode.inode_number;
-    new_parent_inode.deleted = 0;
-    new_parent_inode.mode = parent_log->inode.mode;
-    new_parent_inode.uid = parent_log->inode.uid;
-    new_parent_inode.gid = parent_log->inode.gid;
-    new_parent_inode.flags = parent_log->inode.flags;
-    new_parent_inode.size = parent_log->inode.size + sizeof(*new_dentry);
-    new_parent_inode.atime = time(NULL);
-    new_parent_inode.mtime = time(NULL);
-    new_parent_inode.ctime = time(NULL);
-    new_parent_inode.links = parent_log->inode.links;
-
-    // Update data
-    char *data = malloc(new_parent_inode.size);
-    memcpy(data, parent_log->data, parent_log->inode.size);
-    memcpy(data + parent_log->inode.size, new_dentry, sizeof(*new_dentry));
-
-    // Create new log entry for parent
-    struct wfs_log_entry *new_parent_log = malloc(sizeof(new_parent_inode) + new_parent_inode.size);
-    new_parent_log->inode = new_parent_inode;
-    memcpy(new_parent_log->data, data, new_parent_inode.size);
+    struct wfs_log_entry *new_log = (struct wfs_log_entry *)log_reserve(sizeof(struct wfs_inode) + end);
+    if (new_log == NULL) return -ENOSPC;
+    new_log->inode = attr;
+    new_log->inode.flags = WFS_ENTRY_INODE;
+    new_log->inode.size = end;
+    memcpy(new_log->data, inode_data(inode), used);
+
+    // The fill entry is committed together with the reserved entry
+    ret = write_fill(&attr, used, 1);
+    if (ret < 0) log_abort();
+    return ret;
+}
 
-    // Update the log
-    if (mapped_disk + ((struct wfs_sb *)mapped_disk)->head + sizeof(*new_parent_log) > mapped_disk + DISK_SIZE) return -ENOSPC;
-    memcpy(mapped_disk + ((struct wfs_sb *)mapped_disk)->head, new_parent_log, sizeof(new_parent_inode) + new_parent_inode.size);
-    ((struct wfs_sb *)mapped_disk)->head += sizeof(new_parent_inode) + new_parent_inode.size;
+static int wfs_open(const char *path, struct fuse_file_info *fi) {
+    int ctl = ctl_lookup(path);
+    if (ctl >= 0) return ctl_open(ctl, fi);
 
-    // Free allocated space
-    free(new_dentry);
-    free(data);
-    free(new_parent_log);
+    struct wfs_inode *inode = read_path(path);
+    if (inode == NULL) return -ENOENT;
+    if (S_ISDIR(inode->mode)) return -EISDIR;
+
+    // Let the kernel keep the pages it cached for the file if the file has not changed
+    // since it was last opened, and drop them otherwise
+    struct wfs_imap_slot *slot = &imap[inode->inode_number];
+    fi->keep_cache = (slot->open_entry == slot->entry);
+    slot->open_entry = slot->entry;
+
+    // Opening with O_TRUNC empties the file, including writes still buffered for it
+    if (fi->flags & O_TRUNC) {
+        int ret = flush_wbuf(&inode);
+        if (ret < 0) return ret;
+        if (inode->size != 0) {
+            ret = truncate_file(inode, 0);
+            if (ret < 0) return ret;
+            fi->keep_cache = 0;
+        }
+    }
 
+    fi->fh = inode->inode_number + 1;
     return 0;
 }
 
-static int wfs_mkdir(const char *path, mode_t mode) {
-    // If pathname already exists, or is a symbolic link, fail with EEXIST
-    if (read_path(path) != NULL) return -EEXIST;
-
-    // Create a new log entry for the directory
-    struct wfs_log_entry *new_log = malloc(sizeof(struct wfs_inode));
-
-    // Set the mode and other attributes based on the provided arguments
-    struct wfs_inode inode;
-    inode.inode_number = get_largest_inumber() + 1;
-    inode.deleted = 0;
-    inode.mode = S_IFDIR | mode;
-    inode.uid = getuid();
-    inode.gid = getgid();
-    inode.flags = 0;
-    inode.size = 0;
-    inode.atime = time(NULL);
-    inode.mtime = time(NULL);
-    inode.ctime = time(NULL);
-    inode.links = 1;
-    new_log->inode = inode;
-
-    // Update the log
-    if (mapped_disk + ((struct wfs_sb *)mapped_disk)->head + sizeof(*new_log) > mapped_disk + DISK_SIZE) return -ENOSPC;
-    memcpy(mapped_disk + ((struct wfs_sb *)mapped_disk)->head, new_log, sizeof(*new_log));
-    ((struct wfs_sb *)mapped_disk)->head += sizeof(*new_log);
+static int wfs_flush(const char *path, struct fuse_file_info *fi) {
+    if (ctl_lookup(path) >= 0) return 0;
 
-    free(new_log);
+    struct wfs_inode *inode;
+    int ret = get_inode(path, fi, &inode);
+    if (ret != 0) return ret;
 
-    // Update parent
-    char name[MAX_FILE_NAME_LEN] = {0};
-    char parent_path[MAX_PATH_LEN] = {0};
-    parsepath(name, parent_path, path);
+    return flush_wbuf(&inode);
+}
 
-    // Create directory entry for new directory
-    struct wfs_dentry *new_dentry = malloc(sizeof(struct wfs_dentry));
-    strcpy(new_dentry->name, name);
-    new_dentry->inode_number = inode.inode_number;
+static int wfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    if (ctl_lookup(path) >= 0) return 0;
 
-    // Get existing parent inode
-    struct wfs_inode *parent_inode = read_path(parent_path);
-    if (parent_inode == NULL) return -ENOENT;
-
-    struct wfs_log_entry *parent_log = (struct wfs_log_entry *)parent_inode;
-
-    // Create new inode entry for parent
-    struct wfs_inode new_parent_inode;
-    new_parent_inode.inode_number = parent_log->inode.inode_number;
-    new_parent_inode.deleted = 0;
-    new_parent_inode.mode = parent_log->inode.mode;
-    new_parent_inode.uid = parent_log->inode.uid;
-    new_parent_inode.gid = parent_log->inode.gid;
-    new_parent_inode.flags = parent_log->inode.flags;
-    new_parent_inode.size = parent_log->inode.size + sizeof(*new_dentry);
-    new_parent_inode.atime = time(NULL);
-    new_parent_inode.mtime = time(NULL);
-    new_parent_inode.ctime = time(NULL);
-    new_parent_inode.links = parent_log->inode.links;
-
-    // Update data
-    char *data = malloc(new_parent_inode.size);
-    memcpy(data, parent_log->data, parent_log->inode.size);
-    memcpy(data + parent_log->inode.size, new_dentry, sizeof(*new_dentry));
-
-    // Create new log entry for parent
-    struct wfs_log_entry *new_parent_log = malloc(sizeof(new_parent_inode) + new_parent_inode.size);
-    new_parent_log->inode = new_parent_inode;
-    memcpy(new_parent_log->data, data, new_parent_inode.size);
+    struct wfs_inode *inode;
+    int ret = get_inode(path, fi, &inode);
+    if (ret != 0) return ret;
+
+    ret = flush_wbuf(&inode);
+    if (ret < 0) return ret;
+    if (write_checkpoint() != 0) return -ENOMEM;
+    uint64_t start = phase_begin();
+    ret = msync(mapped_disk, DISK_SIZE, MS_SYNC);
+    phase_end(PHASE_FLUSH, start);
+    return (ret == -1) ? -errno : 0;
+}
 
-    // Update the log
-    if (mapped_disk + ((struct wfs_sb *)mapped_disk)->head + sizeof(*new_parent_log) > mapped_disk + DISK_SIZE) return -ENOSPC;
-    memcpy(mapped_disk + ((struct wfs_sb *)mapped_disk)->head, new_parent_log, sizeof(new_parent_inode) + new_parent_inode.size);
-    ((struct wfs_sb *)mapped_disk)->head += sizeof(new_parent_inode) + new_parent_inode.size;
+static int wfs_release(const char *path, struct fuse_file_info *fi) {
+    if (ctl_lookup(path) >= 0) {
+        ctl_release(fi);
+        return 0;
+    }
 
-    // Free allocated space
-    free(new_dentry);
-    free(data);
-    free(new_parent_log);
+    struct wfs_inode *inode;
+    if (get_inode(path, fi, &inode) != 0) return 0;
 
+    flush_wbuf(&inode);
     return 0;
 }
 
-static int wfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+/**
+ * Reports where the current version of a file lives in the log, for WFS_IOC_LAYOUT.
+ * Buffered writes are flushed first, so the layout is that of what was written.
+*/
+static int wfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
+    if (ctl_lookup(path) >= 0 || (uint)cmd != WFS_IOC_LAYOUT) return -ENOTTY;
+
     struct wfs_inode *inode;
-    if (fi && fi->fh) { // file handle provided
-        inode = (struct wfs_inode *)fi->fh;
-        if (inode == NULL || inode->inode_number < 0 || inode->inode_number > get_largest_inumber())
-            return -EBADF;
-    } else {
-        inode = read_path(path);
-        if (inode == NULL) return -ENOENT;
+    int ret = get_inode(path, fi, &inode);
+    if (ret != 0) return ret;
+    ret = flush_wbuf(&inode);
+    if (ret < 0) return ret;
+
+    struct wfs_imap_slot *slot = &imap[inode->inode_number];
+    struct wfs_layout *layout = data;
+    memset(layout, 0, sizeof(*layout));
+    layout->inode_number = inode->inode_number;
+    if (slot->data != 0) {
+        struct wfs_log_entry *entry = (struct wfs_log_entry *)(mapped_disk + slot->data);
+        layout->records[layout->nrecords++] = (struct wfs_layout_record){
+            slot->data, wfs_entry_len(entry), slot->use.size, entry->inode.flags };
     }
-    if (!S_ISREG(inode->mode)) return -EISDIR;
+    if (slot->entry != slot->data) {
+        struct wfs_log_entry *entry = (struct wfs_log_entry *)(mapped_disk + slot->entry);
+        layout->records[layout->nrecords++] = (struct wfs_layout_record){
+            slot->entry, wfs_entry_len(entry), 0, entry->inode.flags };
+    }
+    layout->superseded = slot->versions - layout->nrecords;
+    layout->contiguous = (layout->nrecords < 2 ||
+                          layout->records[0].offset + layout->records[0].length == layout->records[1].offset);
+    return 0;
+}
 
-    // Calculate the maximum number of bytes that can be read
-    size_t max_size = inode->size - offset;
-    size = (size < max_size) ? size : max_size;
-    if (size < 0) return 0;
+/**
+ * Control socket. With -o ctl=PATH, a thread serves commands on a Unix socket at PATH, one
+ * per line, for tuning and maintaining a mount without remounting it, e.g.
+ *  echo 'set checkpoint_interval 5' | socat - UNIX-CONNECT:PATH
+ * The reply to a command is its output, if any, followed by a line "ok" or "error: <why>".
+ * Commands hold wfs_lock, like operations, so they never see an operation half done.
+ */
+static char sock_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static int sock_fd = -1;     // listening socket, -1 if none
 
-    // Copy data from the log entry to the buffer
-    memcpy(buf, ((struct wfs_log_entry *)inode)->data + offset, size);
+/**
+ * Parses a number argument of a command.
+ *
+ * Returns:
+ *  int: 0 on success, -1 if arg is not a number.
+*/
+static int sock_number(const char *arg, unsigned long long *value) {
+    char *end;
+    if (arg == NULL || *arg == '\0') return -1;
+    *value = strtoull(arg, &end, 10);
+    return (*end == '\0') ? 0 : -1;
+}
 
-    // Update inode metadata since file has been accessed
-    uint current_time = time(NULL);
-    memcpy(&(inode->atime), &(current_time), sizeof(current_time));
-    memcpy(&(inode->ctime), &(current_time), sizeof(current_time));
+static const char *sock_cmd_stats(FILE *out, char *arg) {
+    if (arg != NULL && strcmp(arg, "json")) return "usage: stats [json]";
+    (arg ? stats_report_json : stats_report_text)(out);
+    return NULL;
+}
 
-    return size; // Return the actual number of bytes read
+static const char *sock_cmd_checkpoint(FILE *out, char *arg) {
+    if (write_checkpoint() != 0) return "the log could not be indexed";
+    if (imap_head > WFS_CKPT_OFFSET) return "the log reaches over the checkpoint, run fsck.wfs to make room";
+    fprintf(out, "head %u live_bytes %u dead_bytes %u\n", imap_head, live_bytes, dead_bytes);
+    return NULL;
 }
 
-static int wfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    struct wfs_inode *inode;
-    if (fi && fi->fh) { // file handle provided
-        inode = (struct wfs_inode *)fi->fh;
-        if (inode == NULL || inode->inode_number < 0 || inode->inode_number > get_largest_inumber())
-            return -EBADF;
-    } else {
-        inode = read_path(path);
-        if (inode == NULL) return -ENOENT;
+static const char *sock_cmd_flush(FILE *out, char *arg) {
+    ulong flushed = 0, failed = 0;
+    for (ulong inode_number = 0; inode_number < imap_len; inode_number++) {
+        if (imap[inode_number].wbuf == NULL) continue;
+        struct wfs_inode *inode = read_inumber(inode_number);
+        if (inode != NULL && flush_wbuf(&inode) == 0) flushed++;
+        else failed++;
     }
-    if (!S_ISREG(inode->mode)) return -EISDIR;
-
-    // Determine if there's enough space for write
-    size_t grow_size = offset + size - inode->size;
-    grow_size = (grow_size > 0) ? grow_size : 0;
-    if (mapped_disk + ((struct wfs_sb *)mapped_disk)->head + grow_size > mapped_disk + DISK_SIZE) return -ENOSPC;
+    fprintf(out, "flushed %lu\n", flushed);
+    return failed ? "some buffers could not be flushed" : NULL;
+}
 
-    // Update inode
-    struct wfs_inode new_inode;
-    new_inode.inode_number = inode->inode_number;
-    new_inode.deleted = inode->deleted;
-    new_inode.mode = inode->mode;
-    new_inode.uid = inode->uid;
-    new_inode.gid = inode->gid;
-    new_inode.flags = inode->flags;
-    new_inode.size = inode->size + grow_size;
-    new_inode.atime = time(NULL);
-    new_inode.mtime = time(NULL);
-    new_inode.ctime = time(NULL);
-    new_inode.links = inode->links;
-
-    // Update data
-    char *new_data = malloc(new_inode.size);
-    if (!new_data) return -ENOMEM;
-
-    // Copy existing data to the new buffer
-    memcpy(new_data, ((struct wfs_log_entry *)inode)->data, inode->size);
+static const char *sock_cmd_drop_caches(FILE *out, char *arg) {
+    dcache_drop(0);
+    return NULL;
+}
 
-    // Copy the new data to the appropriate offset
-    memcpy(new_data + offset, buf, size);
-
-    // Create a new log entry for the updated file
-    struct wfs_log_entry *new_log = malloc(sizeof(new_inode) + new_inode.size);
-    new_log->inode = new_inode;
-    memcpy(new_log->data, new_data, new_inode.size);
-    if (mapped_disk + ((struct wfs_sb *)mapped_disk)->head + sizeof(*new_log) + new_inode.size> mapped_disk + DISK_SIZE) {
-        free(new_data);
-        free(new_log);
-        return -ENOSPC;
-    }
+static const char *sock_cmd_trace(FILE *out, char *arg) {
+    const char *path = arg ? arg : trace_path;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) return strerror(errno);
+    trace_dump(trace_write_fd, &fd);
+    close(fd);
+    fprintf(out, "%s\n", path);
+    return NULL;
+}
 
-    memcpy(mapped_disk + ((struct wfs_sb *)mapped_disk)->head, new_log, sizeof(*new_log) + new_inode.size);
-    ((struct wfs_sb *)mapped_disk)->head += sizeof(*new_log) + new_inode.size;
+static const char *sock_cmd_heatmap(FILE *out, char *arg) {
+    if (arg == NULL) return "usage: heatmap PATH";
+    FILE *dump = fopen(arg, "wb");
+    if (dump == NULL) return strerror(errno);
+    heat_report(dump);
+    if (fclose(dump) == EOF) return strerror(errno);
+    fprintf(out, "%s\n", arg);
+    return NULL;
+}
 
-    // Free allocated space
-    free(new_data);
-    free(new_log);
+static const char *sock_cmd_clean(FILE *out, char *arg) {
+    fprintf(out, "dead_bytes %u\n", dead_bytes);
+    return "there is no online cleaner, run fsck.wfs on the unmounted disk to reclaim dead bytes";
+}
 
-    return size;
+static const char *sock_cmd_settings(FILE *out, char *arg) {
+    fprintf(out, "checkpoint_interval %ld\n", (long)checkpoint_interval);
+    fprintf(out, "slow_us %lu\n", (ulong)(slow_ns / 1000));
+    fprintf(out, "summary_s %lu\n", (ulong)(summary_ns / 1000000000));
+    fprintf(out, "profile %d\n", profile);
+    fprintf(out, "dcache_size %zu\n", dcache_size);
+    fprintf(out, "heat_half_life %ld\n", (long)heat_half_life);
+    return NULL;
 }
 
-static int wfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-    struct wfs_inode *inode;
-    if (fi && fi->fh) { // file handle provided
-        inode = (struct wfs_inode *)fi->fh;
-        if (inode == NULL || inode->inode_number < 0 || inode->inode_number > get_largest_inumber())
-            return -EBADF;
+static const char *sock_cmd_set(FILE *out, char *arg) {
+    char *value_arg = arg ? strchr(arg, ' ') : NULL;
+    unsigned long long value;
+    if (value_arg == NULL) return "usage: set <name> <value>";
+    *value_arg++ = '\0';
+    if (sock_number(value_arg, &value) != 0) return "value must be a number";
+
+    if (!strcmp(arg, "checkpoint_interval")) {
+        checkpoint_interval = value;
+    } else if (!strcmp(arg, "slow_us")) {
+        slow_ns = value * 1000;
+    } else if (!strcmp(arg, "summary_s")) {
+        summary_ns = value * 1000000000;
+    } else if (!strcmp(arg, "profile")) {
+        if (value > 1) return "profile must be 0 or 1";
+        profile = value;
+    } else if (!strcmp(arg, "heat_half_life")) {
+        if (value == 0) return "heat_half_life must be at least a second";
+        heat_decay();
+        heat_half_life = value;
+    } else if (!strcmp(arg, "dcache_size")) {
+        if (value == 0 || (value & (value - 1)) != 0) return "dcache_size must be a power of two";
+        dcache_drop(value);
     } else {
-        inode = read_path(path);
-        if (inode == NULL) return -ENOENT;
-    }
-    if (!S_ISDIR(inode->mode)) return -EISNAM; // Error: Not a directory
-    
-    // Look through the directory entries to find the filenames
-    struct wfs_log_entry *log = (struct wfs_log_entry *)inode;
-    struct wfs_dentry *dir_entry = (struct wfs_dentry *)(log->data + offset);
-    int directory_offset = 0;
-    uint current_time = time(NULL);
-    memcpy(&(inode->atime), &(current_time), sizeof(current_time));
-    memcpy(&(inode->ctime), &(current_time), sizeof(current_time));
-    while (directory_offset < inode->size) {
-        // Use the filler function to provide directory entries to FUSE
-        filler(buf, dir_entry->name, NULL, 0);
-        // Move to the next directory entry
-        directory_offset += sizeof(struct wfs_dentry);
-        dir_entry++;
+        return "unknown setting";
     }
-    return 0;
+    return NULL;
 }
 
-static int wfs_unlink(const char *path) {
-    struct wfs_inode *unlink_inode = read_path(path);
-
-    unlink_inode->links--;
-    if (unlink_inode->links == 0)
-        unlink_inode->deleted = 1;
+static const char *sock_cmd_help(FILE *out, char *arg);
+
+static const struct {
+    const char *name;
+    const char *(*run)(FILE *out, char *arg);  // returns NULL on success, or why it failed
+    const char *args;
+    const char *help;
+} sock_commands[] = {
+    { "help",        sock_cmd_help,        "",           "list the commands" },
+    { "stats",       sock_cmd_stats,       "[json]",     "print the statistics, as in /.wfs/stats" },
+    { "checkpoint",  sock_cmd_checkpoint,  "",           "write the space accounting checkpoint now" },
+    { "flush",       sock_cmd_flush,       "",           "append all write-back buffers to the log" },
+    { "drop_caches", sock_cmd_drop_caches, "",           "empty the directory entry cache" },
+    { "trace",       sock_cmd_trace,       "[PATH]",     "dump the trace rings to PATH, or to the trace file" },
+    { "heatmap",     sock_cmd_heatmap,     "PATH",       "dump the access heatmap to PATH, for stat.wfs -H" },
+    { "clean",       sock_cmd_clean,       "",           "unsupported: print the dead bytes fsck.wfs would reclaim" },
+    { "settings",    sock_cmd_settings,    "",           "print the settings that can be changed" },
+    { "set",         sock_cmd_set,         "NAME VALUE", "change a setting" },
+};
+#define SOCK_COMMANDS (sizeof(sock_commands) / sizeof(sock_commands[0]))
 
-    // Update parent
-    char unlink_name[MAX_FILE_NAME_LEN] = {0};
-    char parent_path[MAX_PATH_LEN] = {0};
-    parsepath(unlink_name, parent_path, path);
+static const char *sock_cmd_help(FILE *out, char *arg) {
+    for (size_t i = 0; i < SOCK_COMMANDS; i++)
+        fprintf(out, "%-12s %-15s %s\n", sock_commands[i].name, sock_commands[i].args, sock_commands[i].help);
+    return NULL;
+}
 
-    // Get existing parent inode
-    struct wfs_inode *parent_inode = read_path(parent_path);
-    if (parent_inode == NULL) return -ENOENT;
-
-    struct wfs_log_entry *parent_log = (struct wfs_log_entry *)parent_inode;
-
-    // Create new inode entry for parent
-    struct wfs_inode new_parent_inode;
-    new_parent_inode.inode_number = parent_log->inode.inode_number;
-    new_parent_inode.deleted = 0;
-    new_parent_inode.mode = parent_log->inode.mode;
-    new_parent_inode.uid = parent_log->inode.uid;
-    new_parent_inode.gid = parent_log->inode.gid;
-    new_parent_inode.flags = parent_log->inode.flags;
-    new_parent_inode.size = parent_log->inode.size - sizeof(struct wfs_dentry);
-    new_parent_inode.atime = time(NULL);
-    new_parent_inode.mtime = time(NULL);
-    new_parent_inode.ctime = time(NULL);
-    new_parent_inode.links = parent_log->inode.links;
-
-    // Update data
-    char *data = malloc(new_parent_inode.size);
-    int data_position = 0;
-    for (struct wfs_dentry *dentry = (struct wfs_dentry *)parent_log->data; (char*)dentry < (char*)parent_log->data + parent_log->inode.size; dentry++) {
-        if (!strcmp(dentry->name, unlink_name))
-            continue;
-        memcpy(data + data_position, dentry, sizeof(struct wfs_dentry));
-        data_position += sizeof(struct wfs_dentry);
+/**
+ * Runs a command line and writes its reply. The reply is built in memory while the command
+ * holds wfs_lock, and only sent once it is released, so a client slow to read it does not
+ * stall the operations.
+*/
+static void sock_run(FILE *out, char *line) {
+    char *arg = strchr(line, ' ');
+    if (arg != NULL) *arg++ = '\0';
+    if (line[0] == '\0') return;
+
+    for (size_t i = 0; i < SOCK_COMMANDS; i++) {
+        if (strcmp(line, sock_commands[i].name)) continue;
+        char *reply = NULL;
+        size_t reply_len = 0;
+        FILE *buf = open_memstream(&reply, &reply_len);
+        if (buf == NULL) {
+            fprintf(out, "error: %s\n", strerror(errno));
+            return;
+        }
+        pthread_mutex_lock(&wfs_lock);
+        const char *error = sock_commands[i].run(buf, arg);
+        pthread_mutex_unlock(&wfs_lock);
+        fclose(buf);
+        fwrite(reply, 1, reply_len, out);
+        free(reply);
+        if (error != NULL) fprintf(out, "error: %s\n", error);
+        else fprintf(out, "ok\n");
+        return;
     }
+    fprintf(out, "error: unknown command, try help\n");
+}
 
-    // Create new log entry for parent
-    struct wfs_log_entry *new_parent_log = malloc(sizeof(new_parent_inode) + new_parent_inode.size);
-    new_parent_log->inode = new_parent_inode;
-    memcpy(new_parent_log->data, data, new_parent_inode.size);
-
-    // Update the log
-    if (mapped_disk + ((struct wfs_sb *)mapped_disk)->head + sizeof(*new_parent_log) > mapped_disk + DISK_SIZE) return -ENOSPC;
-    memcpy(mapped_disk + ((struct wfs_sb *)mapped_disk)->head, new_parent_log, sizeof(new_parent_inode) + new_parent_inode.size);
-    ((struct wfs_sb *)mapped_disk)->head += sizeof(new_parent_inode) + new_parent_inode.size;
+/**
+ * Serves the control socket, one connection at a time.
+*/
+static void *sock_serve(void *unused) {
+    // Clients that hang up early must not kill the mount
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    for (;;) {
+        int fd = accept(sock_fd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return NULL;
+        }
+        FILE *in = fdopen(fd, "r");
+        int out_fd = dup(fd);
+        FILE *out = (out_fd != -1) ? fdopen(out_fd, "w") : NULL;
+        if (in == NULL || out == NULL) {
+            if (in != NULL) fclose(in);
+            else close(fd);
+            if (out_fd != -1) close(out_fd);
+            continue;
+        }
 
-    // Free allocated space
-    free(data);
-    free(new_parent_log);
+        char line[PATH_MAX + 64];
+        while (fgets(line, sizeof(line), in) != NULL) {
+            line[strcspn(line, "\r\n")] = '\0';
+            sock_run(out, line);
+            if (fflush(out) == EOF) break;
+        }
+        fclose(out);
+        fclose(in);
+    }
+}
 
-    return 0;
+/**
+ * Listens on the control socket and starts the thread serving it. Failures are logged,
+ * and leave the mount without a control socket.
+*/
+static void sock_start() {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sock_path);
+
+    // Replace the socket left by an earlier mount, but nothing else
+    struct stat st;
+    if (lstat(sock_path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(sock_path);
+
+    sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock_fd == -1 || bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sock_fd, 4) == -1) {
+        syslog(LOG_ERR, "control socket %s: %s", sock_path, strerror(errno));
+        if (sock_fd != -1) close(sock_fd);
+        sock_fd = -1;
+        return;
+    }
+    chmod(sock_path, 0600);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, sock_serve, NULL) != 0) {
+        syslog(LOG_ERR, "control socket %s: cannot start its thread", sock_path);
+        close(sock_fd);
+        unlink(sock_path);
+        sock_fd = -1;
+        return;
+    }
+    pthread_detach(thread);
 }
 
-static int wfs_rmdir(const char *path) {
-    struct wfs_inode *unlink_inode = read_path(path);
+static void wfs_destroy(void *private_data) {
+    pthread_mutex_lock(&wfs_lock);
+    if (sock_fd != -1) {
+        close(sock_fd);
+        unlink(sock_path);
+        sock_fd = -1;
+    }
 
-    unlink_inode->links--;
-    if (unlink_inode->links == 0)
-        unlink_inode->deleted = 1;
+    // Write out everything still buffered, and the access times kept in memory
+    for (ulong inode_number = 0; inode_number < imap_len; inode_number++) {
+        if (read_inumber(inode_number) == NULL) continue;
+        if (imap[inode_number].wbuf != NULL) {
+            struct wfs_inode *inode = read_inumber(inode_number);
+            if (flush_wbuf(&inode) < 0)
+                fprintf(stderr, "Error flushing buffered writes of inode %lu\n", inode_number);
+        }
+        if (imap[inode_number].atime != 0) {
+            struct wfs_inode attr = *read_inumber(inode_number);
+            attr.atime = imap[inode_number].atime;
+            if (write_attr(&attr) < 0)
+                fprintf(stderr, "Error writing access time of inode %lu\n", inode_number);
+        }
+    }
+    if (write_checkpoint() != 0)
+        fprintf(stderr, "Error writing checkpoint\n");
+    pthread_mutex_unlock(&wfs_lock);
+}
 
-    // Update parent
-    char unlink_name[MAX_FILE_NAME_LEN] = {0};
-    char parent_path[MAX_PATH_LEN] = {0};
-    parsepath(unlink_name, parent_path, path);
+static void *wfs_init(struct fuse_conn_info *conn) {
+    // Let FUSE splice read replies from the disk file into /dev/fuse
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
+    // Take writes in large chunks, spliced from /dev/fuse when possible. FUSE lowers
+    // max_write to what its request buffers can hold.
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_BIG_WRITES);
+
+    // Handle O_TRUNC in open rather than in a separate truncate request
+    conn->want |= conn->capable & FUSE_CAP_ATOMIC_O_TRUNC;
+    conn->max_write = MAX_WRITE_SIZE;
+
+    load_checkpoint();
+
+    // Dump the trace on SIGUSR1
+    if (trace_path[0] == '\0')
+        snprintf(trace_path, sizeof(trace_path), "/tmp/mount.wfs.%d.trace", (int)getpid());
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = trace_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    // Started here rather than in main, since FUSE forks when it daemonizes
+    if (sock_path[0] != '\0')
+        sock_start();
+    return NULL;
+}
 
-    // Get existing parent inode
-    struct wfs_inode *parent_inode = read_path(parent_path);
-    if (parent_inode == NULL) return -ENOENT;
-
-    struct wfs_log_entry *parent_log = (struct wfs_log_entry *)parent_inode;
-
-    // Create new inode entry for parent
-    struct wfs_inode new_parent_inode;
-    new_parent_inode.inode_number = parent_log->inode.inode_number;
-    new_parent_inode.deleted = 0;
-    new_parent_inode.mode = parent_log->inode.mode;
-    new_parent_inode.uid = parent_log->inode.uid;
-    new_parent_inode.gid = parent_log->inode.gid;
-    new_parent_inode.flags = parent_log->inode.flags;
-    new_parent_inode.size = parent_log->inode.size - sizeof(struct wfs_dentry);
-    new_parent_inode.atime = time(NULL);
-    new_parent_inode.mtime = time(NULL);
-    new_parent_inode.ctime = time(NULL);
-    new_parent_inode.links = parent_log->inode.links;
-
-    // Update data
-    char *data = malloc(new_parent_inode.size);
-    int data_position = 0;
-    for (struct wfs_dentry *dentry = (struct wfs_dentry *)parent_log->data; (char*)dentry < (char*)parent_log->data + parent_log->inode.size; dentry++) {
-        if (!strcmp(dentry->name, unlink_name))
-            continue;
-        memcpy(data + data_position, dentry, sizeof(struct wfs_dentry));
-        data_position += sizeof(struct wfs_dentry);
+/**
+ * Wrappers that call each operation and record its statistics. Each operation has a pair of
+ * probes, e.g. wfs:read__entry(path) and wfs:read__return(path, ret, inode_number, ns).
+ * Operations run one at a time, under wfs_lock, which the control socket also takes.
+ */
+#define X(id, name, params, args) \
+    static int op_##name params { \
+        struct wfs_op_scope scope; \
+        WFS_PROBE1(name##__entry, path); \
+        pthread_mutex_lock(&wfs_lock); \
+        op_begin(&scope, OP_##id, path); \
+        int ret = op_end(&scope, wfs_##name args); \
+        pthread_mutex_unlock(&wfs_lock); \
+        WFS_PROBE4(name##__return, path, ret, scope.inode_number, scope.end_ns - scope.start_ns); \
+        return ret; \
     }
+WFS_OPS(X)
+#undef X
 
-    // Create new log entry for parent
-    struct wfs_log_entry *new_parent_log = malloc(sizeof(new_parent_inode) + new_parent_inode.size);
-    new_parent_log->inode = new_parent_inode;
-    memcpy(new_parent_log->data, data, new_parent_inode.size);
+static struct fuse_operations wfs_ops = {
+    .getattr    = op_getattr,
+    .statfs     = op_statfs,
+    .mknod      = op_mknod,
+    .mkdir      = op_mkdir,
+    .read       = op_read,
+    .write      = op_write,
+    .readdir    = op_readdir,
+    .unlink     = op_unlink,
+    .rmdir      = op_rmdir,
+    .init       = wfs_init,
+    .read_buf   = op_read_buf,
+    .write_buf  = op_write_buf,
+    .rename     = op_rename,
+    .chmod      = op_chmod,
+    .chown      = op_chown,
+    .utimens    = op_utimens,
+    .truncate   = op_truncate,
+    .ftruncate  = op_ftruncate,
+    .fallocate  = op_fallocate,
+    .create     = op_create,
+    .open       = op_open,
+    .flush      = op_flush,
+    .fsync      = op_fsync,
+    .release    = op_release,
+    .ioctl      = op_ioctl,
+    .destroy    = wfs_destroy,
+
+    .flag_utime_omit_ok = 1,
+};
 
-    // Update the log
-    if (mapped_disk + ((struct wfs_sb *)mapped_disk)->head + sizeof(*new_parent_log) > mapped_disk + DISK_SIZE) return -ENOSPC;
-    memcpy(mapped_disk + ((struct wfs_sb *)mapped_disk)->head, new_parent_log, sizeof(new_parent_inode) + new_parent_inode.size);
-    ((struct wfs_sb *)mapped_disk)->head += sizeof(new_parent_inode) + new_parent_inode.size;
+// bench.wfs includes this file for the operations, with a main of its own
+#ifndef WFS_NO_MAIN
+enum {
+    KEY_NOATIME,
+    KEY_RELATIME,
+    KEY_STRICTATIME,
+    KEY_WRITEBACK_CACHE,
+    KEY_TRACE_FILE,
+    KEY_SLOW_US,
+    KEY_SUMMARY_S,
+    KEY_PROFILE,
+    KEY_CTL,
+};
 
-    // Free allocated space
-    free(data);
-    free(new_parent_log);
+static struct fuse_opt wfs_opts[] = {
+    FUSE_OPT_KEY("noatime", KEY_NOATIME),
+    FUSE_OPT_KEY("relatime", KEY_RELATIME),
+    FUSE_OPT_KEY("strictatime", KEY_STRICTATIME),
+    FUSE_OPT_KEY("writeback_cache", KEY_WRITEBACK_CACHE),
+    FUSE_OPT_KEY("trace_file=%s", KEY_TRACE_FILE),
+    FUSE_OPT_KEY("slow_us=%s", KEY_SLOW_US),
+    FUSE_OPT_KEY("summary_s=%s", KEY_SUMMARY_S),
+    FUSE_OPT_KEY("profile", KEY_PROFILE),
+    FUSE_OPT_KEY("ctl=%s", KEY_CTL),
+    FUSE_OPT_END
+};
 
-    return 0;
+/**
+ * Handles the mount options understood by wfs. Everything else is passed on to FUSE.
+*/
+static int wfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs) {
+    switch (key) {
+    case KEY_NOATIME:
+        atime_mode = ATIME_NOATIME;
+        return 0;
+    case KEY_RELATIME:
+        atime_mode = ATIME_RELATIME;
+        return 0;
+    case KEY_STRICTATIME:
+        atime_mode = ATIME_STRICT;
+        return 0;
+    case KEY_WRITEBACK_CACHE:
+        writeback_cache = 1;
+        return 0;
+    case KEY_PROFILE:
+        profile = 1;
+        return 0;
+    case KEY_TRACE_FILE: {
+        // Relative to where we were started, since FUSE changes to / when it daemonizes
+        const char *path = arg + strlen("trace_file=");
+        char cwd[PATH_MAX] = "";
+        if (path[0] != '/' && getcwd(cwd, sizeof(cwd)) == NULL) {
+            perror("Error getting working directory");
+            return -1;
+        }
+        if (snprintf(trace_path, sizeof(trace_path), "%s%s%s", cwd, cwd[0] ? "/" : "", path) >= sizeof(trace_path)) {
+            fprintf(stderr, "trace_file is too long\n");
+            return -1;
+        }
+        return 0;
+    }
+    case KEY_CTL: {
+        // Relative to where we were started, like trace_file
+        const char *path = arg + strlen("ctl=");
+        char cwd[PATH_MAX] = "";
+        if (path[0] != '/' && getcwd(cwd, sizeof(cwd)) == NULL) {
+            perror("Error getting working directory");
+            return -1;
+        }
+        if (snprintf(sock_path, sizeof(sock_path), "%s%s%s", cwd, cwd[0] ? "/" : "", path) >= sizeof(sock_path)) {
+            fprintf(stderr, "ctl is too long for a socket path\n");
+            return -1;
+        }
+        return 0;
+    }
+    case KEY_SLOW_US: {
+        char *end;
+        unsigned long long slow_us = strtoull(arg + strlen("slow_us="), &end, 10);
+        if (*end != '\0' || end == arg + strlen("slow_us=")) {
+            fprintf(stderr, "slow_us must be a number of microseconds\n");
+            return -1;
+        }
+        slow_ns = slow_us * 1000;
+        return 0;
+    }
+    case KEY_SUMMARY_S: {
+        char *end;
+        unsigned long long summary_s = strtoull(arg + strlen("summary_s="), &end, 10);
+        if (*end != '\0' || end == arg + strlen("summary_s=")) {
+            fprintf(stderr, "summary_s must be a number of seconds\n");
+            return -1;
+        }
+        summary_ns = summary_s * 1000000000;
+        return 0;
+    }
+    }
+    return 1;
 }
 
-static struct fuse_operations wfs_ops = {
-    .getattr    = wfs_getattr,
-    .mknod      = wfs_mknod,
-    .mkdir      = wfs_mkdir,
-    .read       = wfs_read,
-    .write      = wfs_write,
-    .readdir    = wfs_readdir,
-    .unlink     = wfs_unlink,
-    .rmdir      = wfs_rmdir,
-};
-
 int main(int argc, char *argv[]) {
     if (argc < 3 || argv[argc - 2][0] == '-' || argv[argc - 1][0] == '-') {
-        fprintf(stderr, "Usage: %s [FUSE options] disk_path mount_point\n", argv[0]);
+        fprintf(stderr, "Usage: %s [FUSE options] [-o noatime|relatime|strictatime] [-o writeback_cache] [-o trace_file=PATH] [-o slow_us=N] [-o summary_s=N] [-o profile] [-o ctl=PATH] disk_path mount_point\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
@@ -587,19 +3198,33 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    // Close the file
-    close(fd);
+    disk_fd = fd;
 
     // Set up FUSE-specific arguments
     argv[argc - 2] = argv[argc - 1];
     argv[argc - 1] = NULL;
     --argc;
 
+    // Pick out the options handled by wfs itself
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, NULL, wfs_opts, wfs_opt_proc) == -1) {
+        munmap(mapped_disk, sb.st_size);
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    // Slow operations and amplification summaries are logged to syslog, and to stderr
+    // while it is still open
+    openlog("mount.wfs", LOG_PID | LOG_PERROR, LOG_DAEMON);
+
     // Initialize FUSE with specified operations
-    int fuse_ret = fuse_main(argc, argv, &wfs_ops, NULL);
+    int fuse_ret = fuse_main(args.argc, args.argv, &wfs_ops, NULL);
+    fuse_opt_free_args(&args);
 
-    // Unmap the memory
+    // Unmap the memory and close the file
     munmap(mapped_disk, sb.st_size);
-    
+    close(fd);
+
     return fuse_ret;
 }
+#endif // WFS_NO_MAIN
@@ -0,0 +1,403 @@
+#define _DEFAULT_SOURCE
+#include "wfs.h"
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define REGION_SIZE (64 * 1024)  // bytes of the log per region of the garbage report
+#define TOP_INODES 10           // number of largest files and directories reported
+#define HIST_BUCKETS 33         // power of two buckets: 0, 1, 2-3, 4-7, ... up to 2^31 and over
+
+/**
+ * What is known of an inode at the current position of the pass: as for the inode map of
+ * mount.wfs, its latest entry and its latest data entry.
+ */
+struct inode_stat {
+    uint32_t entry;     // offset of the latest log entry, 0 if none
+    uint32_t data;      // offset of the latest log entry holding the data, 0 if none
+    struct wfs_data_use use; // how much of that entry's data is in use by the file
+    uint32_t entry_len; // bytes of the latest log entry
+    uint32_t data_len;  // bytes of the latest data entry
+    uint32_t versions;  // number of log entries of the inode
+    uint32_t mode;      // mode in the latest entry
+    uint32_t size;      // size in the latest entry
+    uint32_t flags;     // kind of the latest entry
+    uint32_t deleted;   // deleted field of the latest entry
+};
+
+static char *mapped_disk = NULL;
+static size_t disk_len = 0;
+
+static struct inode_stat *inodes = NULL;  // indexed by inode number
+static ulong inodes_len = 0;
+static uint64_t *region_bytes = NULL;     // bytes of entries in each region
+static uint64_t *region_live = NULL;      // bytes of live entries in each region
+static size_t nregions = 0;
+
+static struct wfs_heat_header heat_header;  // of the heatmap dump given with -H, if any
+static uint64_t *region_read = NULL;      // bytes read in each region, from the heatmap
+static uint64_t *region_written = NULL;   // bytes written in each region, from the heatmap
+
+static uint64_t entries = 0;
+static uint64_t kind_entries[WFS_ENTRY_RESERVE + 2] = {0}; // the last one counts unknown kinds
+static int truncated = 0;                 // 1 if the pass stopped at an entry past the head
+
+/**
+ * Adds the bytes of a range of the log to the regions it spans, each getting the part of
+ * the range inside it, so an entry crossing a boundary is split between regions.
+ *
+ * Parameters:
+ *  regions (uint64_t*): the counts of the regions, nregions of them.
+ *  offset (uint32_t): offset of the range in the disk.
+ *  len (uint32_t): bytes in the range.
+*/
+static void region_add(uint64_t *regions, uint32_t offset, uint32_t len) {
+    while (len > 0 && offset / REGION_SIZE < nregions) {
+        uint32_t part = REGION_SIZE - offset % REGION_SIZE;
+        if (part > len) part = len;
+        regions[offset / REGION_SIZE] += part;
+        offset += part;
+        len -= part;
+    }
+}
+
+/**
+ * Makes room for an inode number in the inode table.
+ *
+ * Returns:
+ *  int: 0 on success, -1 if the table could not be grown.
+*/
+static int grow_inodes(ulong inode_number) {
+    if (inode_number < inodes_len) return 0;
+    ulong new_len = inodes_len ? inodes_len : 64;
+    while (new_len <= inode_number) new_len *= 2;
+    struct inode_stat *new_inodes = realloc(inodes, new_len * sizeof(*inodes));
+    if (new_inodes == NULL) return -1;
+    memset(new_inodes + inodes_len, 0, (new_len - inodes_len) * sizeof(*inodes));
+    inodes = new_inodes;
+    inodes_len = new_len;
+    return 0;
+}
+
+/**
+ * Walks the log once, from the superblock to the head, keeping only the latest entries of
+ * each inode and the bytes of each region. Pages behind the walk are dropped from the
+ * mapping, so memory stays bounded by the number of inodes and regions however large the
+ * image is.
+ *
+ * Returns:
+ *  int: 0 on success, -1 on failure.
+*/
+static int scan_log() {
+    struct wfs_sb *superblock = (struct wfs_sb *)mapped_disk;
+    uint32_t position = sizeof(struct wfs_sb);
+    size_t dropped = 0;     // bytes at the start of the mapping already dropped
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    while (position < superblock->head) {
+        struct wfs_log_entry *current_entry = (struct wfs_log_entry *)(mapped_disk + position);
+        if (position + sizeof(struct wfs_inode) > superblock->head ||
+            position + wfs_entry_len(current_entry) > superblock->head) {
+            truncated = 1;
+            break;
+        }
+        ulong inode_number = current_entry->inode.inode_number;
+        uint32_t len = wfs_entry_len(current_entry);
+        if (grow_inodes(inode_number) == -1) {
+            perror("Error growing inode table");
+            return -1;
+        }
+
+        entries++;
+        kind_entries[current_entry->inode.flags <= WFS_ENTRY_RESERVE ? current_entry->inode.flags
+                                                                     : WFS_ENTRY_RESERVE + 1]++;
+        region_add(region_bytes, position, len);
+
+        // Same rules as the inode map of mount.wfs and the folding of fsck.wfs
+        struct inode_stat *inode = &inodes[inode_number];
+        inode->entry = position;
+        inode->entry_len = len;
+        inode->versions++;
+        inode->mode = current_entry->inode.mode;
+        inode->size = current_entry->inode.size;
+        inode->flags = current_entry->inode.flags;
+        inode->deleted = current_entry->inode.deleted;
+        if (current_entry->inode.flags == WFS_ENTRY_INODE) {
+            inode->data = position;
+            inode->data_len = len;
+        } else if (current_entry->inode.flags == WFS_ENTRY_TOMBSTONE) {
+            inode->data = 0;
+            inode->data_len = 0;
+        }
+        wfs_data_use_apply(&inode->use, current_entry);
+        position += len;
+
+        if (position - dropped >= 16 * (size_t)REGION_SIZE) {
+            size_t drop_to = position / page_size * page_size;
+            madvise(mapped_disk + dropped, drop_to - dropped, MADV_DONTNEED);
+            dropped = drop_to;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Reads a heatmap dump, as written by mount.wfs, and adds its counts to the regions they
+ * fall in.
+ *
+ * Parameters:
+ *  path (const char*): path to the dump.
+ *
+ * Returns:
+ *  int: 0 on success, -1 on failure.
+*/
+static int read_heatmap(const char *path) {
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        perror("Error opening heatmap");
+        return -1;
+    }
+    if (fread(&heat_header, sizeof(heat_header), 1, in) != 1 || heat_header.magic != WFS_HEAT_MAGIC ||
+        heat_header.bucket_size == 0) {
+        fprintf(stderr, "%s is not a heatmap dump\n", path);
+        fclose(in);
+        return -1;
+    }
+
+    region_read = calloc(nregions, sizeof(uint64_t));
+    region_written = calloc(nregions, sizeof(uint64_t));
+    if (region_read == NULL || region_written == NULL) {
+        perror("Error allocating regions");
+        fclose(in);
+        return -1;
+    }
+    for (uint32_t bucket = 0; bucket < heat_header.nbuckets; bucket++) {
+        struct wfs_heat_bucket counts;
+        if (fread(&counts, sizeof(counts), 1, in) != 1) {
+            fprintf(stderr, "Truncated heatmap dump\n");
+            fclose(in);
+            return -1;
+        }
+        // Buckets larger than a region are charged to the region they start in
+        size_t region = (uint64_t)bucket * heat_header.bucket_size / REGION_SIZE;
+        if (region >= nregions) continue;
+        region_read[region] += counts.read;
+        region_written[region] += counts.written;
+    }
+    fclose(in);
+    return 0;
+}
+
+/**
+ * Adds a value to a power of two histogram.
+*/
+static void hist_add(uint64_t *hist, uint64_t value) {
+    int bucket = 0;
+    while (value != 0 && bucket < HIST_BUCKETS - 1) {
+        value >>= 1;
+        bucket++;
+    }
+    hist[bucket]++;
+}
+
+/**
+ * Prints a power of two histogram as a JSON array of [low, high, count], empty buckets
+ * left out.
+*/
+static void hist_print(const char *name, const uint64_t *hist) {
+    printf("\"%s\":[", name);
+    int first = 1;
+    for (int bucket = 0; bucket < HIST_BUCKETS; bucket++) {
+        if (hist[bucket] == 0) continue;
+        uint64_t low = bucket ? 1ULL << (bucket - 1) : 0;
+        uint64_t high = bucket ? (bucket == HIST_BUCKETS - 1 ? UINT32_MAX : (1ULL << bucket) - 1) : 0;
+        printf("%s[%lu,%lu,%lu]", first ? "" : ",", (ulong)low, (ulong)high, (ulong)hist[bucket]);
+        first = 0;
+    }
+    printf("]");
+}
+
+/**
+ * Inserts an inode into a list of the inodes with the most of some value, most first.
+*/
+static void top_add(ulong *top, uint64_t *values, int *ntop, ulong inode_number, uint64_t value) {
+    int pos = *ntop;
+    while (pos > 0 && values[pos - 1] < value) pos--;
+    if (pos >= TOP_INODES) return;
+    if (*ntop < TOP_INODES) (*ntop)++;
+    memmove(&top[pos + 1], &top[pos], (*ntop - 1 - pos) * sizeof(ulong));
+    memmove(&values[pos + 1], &values[pos], (*ntop - 1 - pos) * sizeof(uint64_t));
+    top[pos] = inode_number;
+    values[pos] = value;
+}
+
+/**
+ * Prints the report on the log as JSON, from what the pass kept of it.
+*/
+static void print_report() {
+    struct wfs_sb *superblock = (struct wfs_sb *)mapped_disk;
+    uint64_t log_bytes = 0, live = 0, kept_len = 0;
+    uint64_t live_inodes = 0, deleted_inodes = 0, files = 0, directories = 0;
+    uint64_t versions[HIST_BUCKETS] = {0}, fanout[HIST_BUCKETS] = {0};
+    ulong top_files[TOP_INODES], top_dirs[TOP_INODES];
+    uint64_t file_sizes[TOP_INODES], dir_entries[TOP_INODES];
+    int nfiles = 0, ndirs = 0;
+
+    for (size_t region = 0; region < nregions; region++)
+        log_bytes += region_bytes[region];
+
+    for (ulong inode_number = 0; inode_number < inodes_len; inode_number++) {
+        struct inode_stat *inode = &inodes[inode_number];
+        if (inode->entry == 0) continue;
+        if (inode->flags == WFS_ENTRY_TOMBSTONE) {
+            deleted_inodes++;
+            continue;
+        }
+
+        // Live entries, as counted by mount.wfs: the latest entry and the latest data entry
+        live += inode->entry_len;
+        region_add(region_live, inode->entry, inode->entry_len);
+        if (inode->data != 0 && inode->data != inode->entry) {
+            live += inode->data_len;
+            region_add(region_live, inode->data, inode->data_len);
+        }
+
+        // What fsck.wfs would keep: one folded entry, and an attribute entry for a hole at the end
+        if (inode->deleted) {
+            deleted_inodes++;
+            continue;
+        }
+        if (inode->data != 0) {
+            kept_len += sizeof(struct wfs_inode) + inode->use.size;
+            if (inode->use.size != inode->size)
+                kept_len += sizeof(struct wfs_inode);
+        }
+
+        live_inodes++;
+        hist_add(versions, inode->versions);
+        if (S_ISDIR(inode->mode)) {
+            directories++;
+            uint64_t dentries = inode->use.size / sizeof(struct wfs_dentry);
+            hist_add(fanout, dentries);
+            top_add(top_dirs, dir_entries, &ndirs, inode_number, dentries);
+        } else if (S_ISREG(inode->mode)) {
+            files++;
+            top_add(top_files, file_sizes, &nfiles, inode_number, inode->size);
+        }
+    }
+
+    printf("{\"image\":{\"size\":%lu,\"head\":%u,\"truncated\":%s},", (ulong)disk_len, superblock->head,
+           truncated ? "true" : "false");
+    printf("\"entries\":{\"total\":%lu,\"inode\":%lu,\"attr\":%lu,\"fill\":%lu,\"tombstone\":%lu,\"reserve\":%lu,"
+           "\"unknown\":%lu},", (ulong)entries, (ulong)kind_entries[WFS_ENTRY_INODE], (ulong)kind_entries[WFS_ENTRY_ATTR],
+           (ulong)kind_entries[WFS_ENTRY_FILL], (ulong)kind_entries[WFS_ENTRY_TOMBSTONE],
+           (ulong)kind_entries[WFS_ENTRY_RESERVE], (ulong)kind_entries[WFS_ENTRY_RESERVE + 1]);
+    printf("\"bytes\":{\"log\":%lu,\"live\":%lu,\"superseded\":%lu,\"garbage_ratio\":%.4f},", (ulong)log_bytes,
+           (ulong)live, (ulong)(log_bytes - live), log_bytes ? (double)(log_bytes - live) / log_bytes : 0.0);
+    printf("\"fsck\":{\"head\":%lu,\"reclaimed\":%lu},",
+           (ulong)(sizeof(struct wfs_sb) + kept_len), (ulong)(log_bytes - kept_len));
+    printf("\"inodes\":{\"live\":%lu,\"deleted\":%lu,\"files\":%lu,\"directories\":%lu},",
+           (ulong)live_inodes, (ulong)deleted_inodes, (ulong)files, (ulong)directories);
+    hist_print("versions", versions);
+    printf(",");
+    hist_print("fanout", fanout);
+
+    printf(",\"largest_files\":[");
+    for (int i = 0; i < nfiles; i++)
+        printf("%s{\"inode\":%lu,\"size\":%lu,\"versions\":%u}", i ? "," : "", top_files[i],
+               (ulong)file_sizes[i], inodes[top_files[i]].versions);
+    printf("],\"largest_directories\":[");
+    for (int i = 0; i < ndirs; i++)
+        printf("%s{\"inode\":%lu,\"entries\":%lu,\"versions\":%u}", i ? "," : "", top_dirs[i],
+               (ulong)dir_entries[i], inodes[top_dirs[i]].versions);
+
+    printf("]");
+    if (region_read != NULL)
+        printf(",\"heatmap\":{\"bucket_size\":%u,\"half_life_s\":%u}", heat_header.bucket_size,
+               heat_header.half_life_s);
+    printf(",\"regions\":{\"size\":%d,\"garbage\":[", REGION_SIZE);
+    int printed = 0;
+    for (size_t region = 0; region < nregions; region++) {
+        // Regions the pass did not reach, if it stopped short of the head, have no entries
+        if (region_bytes[region] == 0) continue;
+        printf("%s{\"offset\":%lu,\"bytes\":%lu,\"live\":%lu,\"ratio\":%.4f", printed++ ? "," : "",
+               (ulong)(region * REGION_SIZE), (ulong)region_bytes[region], (ulong)region_live[region],
+               (double)(region_bytes[region] - region_live[region]) / region_bytes[region]);
+        if (region_read != NULL)
+            printf(",\"read\":%lu,\"written\":%lu", (ulong)region_read[region], (ulong)region_written[region]);
+        printf("}");
+    }
+    printf("]}}\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *heatmap_path = (argc == 4 && !strcmp(argv[1], "-H")) ? argv[2] : NULL;
+    if (argc != 2 && heatmap_path == NULL) {
+        fprintf(stderr, "Usage: %s [-H heatmap_dump] <disk_path>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    const char *disk_path = argv[argc - 1];
+
+    // Open the disk file read-only: the image may be in use by a mount
+    int fd = open(disk_path, O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening file");
+        exit(EXIT_FAILURE);
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) {
+        perror("Error getting file size");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+    disk_len = sb.st_size;
+    if (disk_len < sizeof(struct wfs_sb)) {
+        fprintf(stderr, "%s is not a wfs disk\n", disk_path);
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    mapped_disk = mmap(NULL, disk_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped_disk == MAP_FAILED) {
+        perror("Error mapping file into memory");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    madvise(mapped_disk, disk_len, MADV_SEQUENTIAL);
+
+    struct wfs_sb *superblock = (struct wfs_sb *)mapped_disk;
+    if (superblock->magic != WFS_MAGIC || superblock->head < sizeof(struct wfs_sb) || superblock->head > disk_len) {
+        fprintf(stderr, "%s is not a wfs disk\n", disk_path);
+        exit(EXIT_FAILURE);
+    }
+
+    nregions = (superblock->head + REGION_SIZE - 1) / REGION_SIZE;
+    region_bytes = calloc(nregions, sizeof(uint64_t));
+    region_live = calloc(nregions, sizeof(uint64_t));
+    if (region_bytes == NULL || region_live == NULL) {
+        perror("Error allocating regions");
+        exit(EXIT_FAILURE);
+    }
+
+    if (heatmap_path != NULL && read_heatmap(heatmap_path) == -1) {
+        fprintf(stderr, "Failed to read heatmap dump.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (scan_log() == -1) {
+        fprintf(stderr, "Failed to scan the log.\n");
+        exit(EXIT_FAILURE);
+    }
+    print_report();
+
+    munmap(mapped_disk, disk_len);
+    free(inodes);
+    free(region_bytes);
+    free(region_live);
+    free(region_read);
+    free(region_written);
+    return 0;
+}
@@ -0,0 +1,161 @@
+#include "wfs.h"
+#include <errno.h>
+#include <sys/stat.h>
+
+/**
+ * An event of the dump, with the thread that recorded it.
+ */
+struct trace_entry {
+    struct wfs_trace_event event;
+    uint32_t tid;
+};
+
+static char (*op_names)[WFS_TRACE_OP_NAME_LEN] = NULL;  // names of the operations in the dump
+static uint32_t nops = 0;
+static struct trace_entry *entries = NULL;
+static size_t nentries = 0;
+
+/**
+ * Reads a trace dump, as written by mount.wfs on SIGUSR1 or read from /.wfs/trace.
+ *
+ * Parameters:
+ *  path (const char*): path to the dump.
+ *
+ * Returns:
+ *  int: 0 on success, -1 on failure.
+*/
+static int read_dump(const char *path) {
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        perror("Error opening dump");
+        return -1;
+    }
+
+    struct wfs_trace_header header;
+    if (fread(&header, sizeof(header), 1, in) != 1 || header.magic != WFS_TRACE_MAGIC) {
+        fprintf(stderr, "%s is not a trace dump\n", path);
+        fclose(in);
+        return -1;
+    }
+    nops = header.nops;
+    op_names = calloc(nops, WFS_TRACE_OP_NAME_LEN);
+    if (op_names == NULL || fread(op_names, WFS_TRACE_OP_NAME_LEN, nops, in) != nops) {
+        fprintf(stderr, "Truncated trace dump\n");
+        fclose(in);
+        return -1;
+    }
+    for (uint32_t op = 0; op < nops; op++)
+        op_names[op][WFS_TRACE_OP_NAME_LEN - 1] = '\0';
+
+    struct wfs_trace_thread thread;
+    while (fread(&thread, sizeof(thread), 1, in) == 1) {
+        struct trace_entry *new_entries = realloc(entries, (nentries + thread.nevents) * sizeof(*entries));
+        if (new_entries == NULL) {
+            perror("Error reading dump");
+            fclose(in);
+            return -1;
+        }
+        entries = new_entries;
+        for (uint32_t i = 0; i < thread.nevents; i++) {
+            if (fread(&entries[nentries].event, sizeof(struct wfs_trace_event), 1, in) != 1) {
+                fprintf(stderr, "Truncated trace dump\n");
+                fclose(in);
+                return -1;
+            }
+            entries[nentries].tid = thread.tid;
+            // Events overwritten while they were dumped may be torn
+            if (entries[nentries].event.op < nops && entries[nentries].event.end_ns >= entries[nentries].event.start_ns)
+                nentries++;
+        }
+    }
+
+    fclose(in);
+    return 0;
+}
+
+static int compare_start(const void *a, const void *b) {
+    uint64_t start_a = ((const struct trace_entry *)a)->event.start_ns;
+    uint64_t start_b = ((const struct trace_entry *)b)->event.start_ns;
+    return (start_a > start_b) - (start_a < start_b);
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t value_a = *(const uint64_t *)a, value_b = *(const uint64_t *)b;
+    return (value_a > value_b) - (value_a < value_b);
+}
+
+/**
+ * Prints the events of all threads as one timeline, with times relative to the first event.
+*/
+static void print_timeline() {
+    printf("%12s %8s %-10s %10s %12s %10s %10s %10s %6s\n",
+           "start_us", "tid", "op", "inode", "offset", "size", "appended", "dur_us", "error");
+    for (size_t i = 0; i < nentries; i++) {
+        struct wfs_trace_event *event = &entries[i].event;
+        char inode[16] = "-";
+        if (event->inode_number != WFS_TRACE_NO_INODE)
+            snprintf(inode, sizeof(inode), "%u", event->inode_number);
+        printf("%12.3f %8u %-10s %10s %12lu %10u %10u %10.3f %6d\n",
+               (event->start_ns - entries[0].event.start_ns) / 1000.0, entries[i].tid, op_names[event->op],
+               inode, (ulong)event->offset, event->size, event->appended,
+               (event->end_ns - event->start_ns) / 1000.0, event->error);
+    }
+}
+
+/**
+ * Prints, for each operation in the dump, its count, errors, latencies and log appends.
+*/
+static void print_summary() {
+    uint64_t *durations = malloc(nentries * sizeof(uint64_t));
+    if (durations == NULL && nentries > 0) {
+        perror("Error summarizing dump");
+        return;
+    }
+
+    printf("%-10s %8s %8s %10s %10s %10s %10s %12s\n",
+           "op", "count", "errors", "avg_us", "p50_us", "p99_us", "max_us", "appended");
+    for (uint32_t op = 0; op < nops; op++) {
+        size_t count = 0, errors = 0;
+        uint64_t total_ns = 0, appended = 0;
+        for (size_t i = 0; i < nentries; i++) {
+            struct wfs_trace_event *event = &entries[i].event;
+            if (event->op != op) continue;
+            durations[count++] = event->end_ns - event->start_ns;
+            total_ns += event->end_ns - event->start_ns;
+            appended += event->appended;
+            if (event->error != 0) errors++;
+        }
+        if (count == 0) continue;
+
+        qsort(durations, count, sizeof(uint64_t), compare_u64);
+        printf("%-10s %8zu %8zu %10.3f %10.3f %10.3f %10.3f %12lu\n", op_names[op], count, errors,
+               total_ns / 1000.0 / count, durations[count / 2] / 1000.0, durations[count * 99 / 100] / 1000.0,
+               durations[count - 1] / 1000.0, (ulong)appended);
+    }
+    free(durations);
+}
+
+int main(int argc, char *argv[]) {
+    int summary_only = (argc == 3 && !strcmp(argv[1], "-s"));
+    if (argc != 2 && !summary_only) {
+        fprintf(stderr, "Usage: %s [-s] <dump_path>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Read the dump and order the events of all threads by their start
+    if (read_dump(argv[argc - 1]) == -1) {
+        fprintf(stderr, "Failed to read trace dump.\n");
+        exit(EXIT_FAILURE);
+    }
+    qsort(entries, nentries, sizeof(*entries), compare_start);
+
+    if (!summary_only) {
+        print_timeline();
+        printf("\n");
+    }
+    print_summary();
+
+    free(entries);
+    free(op_names);
+    return 0;
+}
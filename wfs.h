@@ -10,6 +10,31 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
+#include <sys/ioctl.h>
+
+/**
+ * USDT probes of provider "wfs", for perf and bpftrace. They compile to NOPs, and to nothing
+ * at all where sys/sdt.h is not installed. For example, bytes scanned per path component:
+ *  bpftrace -e 'usdt:./mount.wfs:wfs:path__step { @scanned = hist(arg3); }'
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define WFS_HAVE_SDT
+#endif
+#endif
+
+#ifdef WFS_HAVE_SDT
+#define WFS_PROBE1(name, a) DTRACE_PROBE1(wfs, name, a)
+#define WFS_PROBE2(name, a, b) DTRACE_PROBE2(wfs, name, a, b)
+#define WFS_PROBE3(name, a, b, c) DTRACE_PROBE3(wfs, name, a, b, c)
+#define WFS_PROBE4(name, a, b, c, d) DTRACE_PROBE4(wfs, name, a, b, c, d)
+#else
+#define WFS_PROBE1(name, a) do {} while (0)
+#define WFS_PROBE2(name, a, b) do {} while (0)
+#define WFS_PROBE3(name, a, b, c) do {} while (0)
+#define WFS_PROBE4(name, a, b, c, d) do {} while (0)
+#endif
 
 #define MAX_FILE_NAME_LEN 32
 #define MAX_PATH_LEN 100
@@ -21,13 +46,29 @@ struct wfs_sb {
     uint32_t head;
 };
 
+/**
+ * Checkpoint of the space accounting, kept in the last bytes of the disk, past the end of
+ * the log. Its counters cover the log up to head, so a mount only has to account for the
+ * entries appended after it. A checkpoint with a head past the head of the log is stale.
+ */
+struct wfs_ckpt {
+    uint32_t magic;         // WFS_CKPT_MAGIC if the checkpoint is valid
+    uint32_t head;          // head of the log when the checkpoint was written
+    uint32_t live_bytes;    // bytes of entries holding the latest data or attributes of an inode
+    uint32_t dead_bytes;    // bytes of superseded entries, reclaimed by fsck.wfs
+    uint32_t inodes;        // number of inodes in the log
+};
+
+#define WFS_CKPT_MAGIC 0x636b7074
+#define WFS_CKPT_OFFSET (DISK_SIZE - sizeof(struct wfs_ckpt)) // also the end of the log
+
 struct wfs_inode {
     uint inode_number;
     uint deleted;       // 1 if deleted, 0 otherwise
     uint mode;          // type. S_IFDIR if the inode represents a directory or S_IFREG if it's for a file
     uint uid;           // user id
     uint gid;           // group id
-    uint flags;         // flags
+    uint flags;         // kind of log entry, one of WFS_ENTRY_*
     uint size;          // size in bytes
     uint atime;         // last access time
     uint mtime;         // last modify time
@@ -35,6 +76,8 @@ struct wfs_inode {
     uint links;         // number of hard links to this file (this can always be set to 1)
 };
 
+// Entries of a directory are kept in increasing inode_number order, which readdir relies on
+// to resume a listing from a cookie.
 struct wfs_dentry {
     char name[MAX_FILE_NAME_LEN];
     ulong inode_number;
@@ -45,4 +88,150 @@ struct wfs_log_entry {
     char data[];
 };
 
+// Kinds of log entries
+#define WFS_ENTRY_INODE 0   // inode followed by size bytes of data
+#define WFS_ENTRY_ATTR  1   // inode only: supersedes the attributes of the inode, while its
+                            // data stays in its latest WFS_ENTRY_INODE entry
+#define WFS_ENTRY_FILL  2   // inode followed by a uint: like WFS_ENTRY_ATTR, and also sets how
+                            // many bytes of the data in the latest WFS_ENTRY_INODE entry are in
+                            // use, the rest being a hole
+#define WFS_ENTRY_TOMBSTONE 3 // inode only: the inode is deleted, and all of its entries,
+                              // this one included, are dead
+#define WFS_ENTRY_RESERVE 4 // like WFS_ENTRY_FILL, for space reserved by fallocate: the bytes
+                            // past those in use were never part of the file, so writes may
+                            // fill them in place
+
+/**
+ * Gets the number of bytes a log entry takes up in the log.
+*/
+static inline size_t wfs_entry_len(const struct wfs_log_entry *entry) {
+    switch (entry->inode.flags) {
+    case WFS_ENTRY_ATTR:
+    case WFS_ENTRY_TOMBSTONE:
+        return sizeof(struct wfs_inode);
+    case WFS_ENTRY_FILL:
+    case WFS_ENTRY_RESERVE:
+        return sizeof(struct wfs_inode) + sizeof(uint);
+    default:
+        return sizeof(struct wfs_inode) + entry->inode.size;
+    }
+}
+
+/**
+ * How much of the data in the latest WFS_ENTRY_INODE entry of an inode is in use by the
+ * file, as of some entry of the inode.
+ */
+struct wfs_data_use {
+    uint32_t capacity;  // bytes of data in the latest WFS_ENTRY_INODE entry, 0 if none
+    uint32_t size;      // bytes of that data in use; past them is a hole
+    uint32_t reserved;  // 1 if the bytes past size were reserved and never written, else 0
+};
+
+/**
+ * Updates the data in use of an inode for its next entry in the log. Starting from all
+ * zeros and applying the entries of an inode in log order gives the data of its current
+ * version.
+ *
+ * Parameters:
+ *  use (wfs_data_use*): the data in use before the entry, updated.
+ *  entry (wfs_log_entry*): the next entry of the inode.
+*/
+static inline void wfs_data_use_apply(struct wfs_data_use *use, const struct wfs_log_entry *entry) {
+    switch (entry->inode.flags) {
+    case WFS_ENTRY_INODE:
+        use->capacity = use->size = entry->inode.size;
+        use->reserved = 0;
+        return;
+    case WFS_ENTRY_TOMBSTONE:
+        use->capacity = use->size = use->reserved = 0;
+        return;
+    case WFS_ENTRY_FILL:
+    case WFS_ENTRY_RESERVE: {
+        uint used = *(const uint *)entry->data;
+        use->size = (used < use->capacity) ? used : use->capacity;
+        use->reserved = (entry->inode.flags == WFS_ENTRY_RESERVE);
+        break;
+    }
+    }
+    // Truncated: bytes cut off stay cut off, even if the file grows again
+    if (entry->inode.size < use->size) {
+        use->size = entry->inode.size;
+        use->reserved = 0;
+    }
+}
+
+/**
+ * Layout of a file in the log, from ioctl(fd, WFS_IOC_LAYOUT, &layout) on an open file of a
+ * mount. The current version of a file is its latest data entry, which holds all of its
+ * data, and its latest attribute entry, if the attributes changed since. Records come in log
+ * order.
+ */
+#define WFS_LAYOUT_RECORDS 2
+
+struct wfs_layout_record {
+    uint32_t offset;        // offset of the log entry in the disk
+    uint32_t length;        // bytes of the log entry, inode included
+    uint32_t data_size;     // bytes of its data in use by the file, 0 for attribute entries
+    uint32_t kind;          // one of WFS_ENTRY_*
+};
+
+struct wfs_layout {
+    uint32_t inode_number;
+    uint32_t nrecords;
+    uint32_t superseded;    // entries of the inode still in the log, not part of the current version
+    uint32_t contiguous;    // 1 if the records of the current version are adjacent in the log
+    struct wfs_layout_record records[WFS_LAYOUT_RECORDS];
+};
+
+#define WFS_IOC_LAYOUT _IOR('W', 1, struct wfs_layout)
+
+/**
+ * Trace dumps written by mount.wfs and decoded by trace.wfs. A dump is a wfs_trace_header,
+ * the names of nops operations of WFS_TRACE_OP_NAME_LEN bytes each, and then, for every
+ * thread, a wfs_trace_thread followed by its events, oldest first.
+ */
+#define WFS_TRACE_MAGIC 0x77667472
+#define WFS_TRACE_OP_NAME_LEN 16
+#define WFS_TRACE_NO_INODE 0xffffffff
+
+struct wfs_trace_header {
+    uint32_t magic;
+    uint32_t nops;
+};
+
+struct wfs_trace_thread {
+    uint32_t tid;
+    uint32_t nevents;
+};
+
+struct wfs_trace_event {
+    uint64_t start_ns;      // CLOCK_MONOTONIC
+    uint64_t end_ns;
+    uint64_t offset;        // offset in the file, or the size for truncations
+    uint32_t inode_number;  // WFS_TRACE_NO_INODE if the operation did not get to an inode
+    uint32_t size;          // bytes requested
+    uint32_t appended;      // bytes appended to the log
+    int16_t error;          // negative errno, 0 on success
+    uint16_t op;            // index into the operation names
+};
+
+/**
+ * Heatmap dumps written by mount.wfs and read by stat.wfs. A dump is a wfs_heat_header
+ * followed by nbuckets wfs_heat_buckets, one for each bucket_size bytes of the disk. Counts
+ * are bytes of the log read and written, halved every half_life_s seconds.
+ */
+#define WFS_HEAT_MAGIC 0x77666874
+
+struct wfs_heat_header {
+    uint32_t magic;
+    uint32_t bucket_size;
+    uint32_t nbuckets;
+    uint32_t half_life_s;
+};
+
+struct wfs_heat_bucket {
+    uint64_t read;
+    uint64_t written;
+};
+
 #endif // MOUNT_WFS_H_